@@ -53,20 +53,48 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setasid: set the address space ID that entries are matched
+ *        against. The functions above leave it alone; the ENTRYHI
+ *        they are passed carries the ID of the entry in question.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
+
+/*
+ * TLB replacement (tlbpolicy.c), for loading entries from vm_fault.
+ * Call with interrupts off.
+ *
+ *   tlb_replace: write the entry into a free slot if one can be found
+ *        cheaply, else into one chosen by the configured policy, and
+ *        count a TLB fault with free or with replace. The policy is
+ *        picked at build time: the processor's random slot by default,
+ *        or per-CPU round robin with "options tlbrr" in the kernel
+ *        config.
+ *
+ *   tlb_prefill: same as tlb_replace, for an entry loaded ahead of
+ *        use rather than for a fault; nothing is counted.
+ *
+ *   tlb_flushed: tell the policy that every slot of this CPU's TLB
+ *        has just been invalidated.
+ */
+
+void tlb_replace(uint32_t entryhi, uint32_t entrylo);
+void tlb_prefill(uint32_t entryhi, uint32_t entrylo);
+void tlb_flushed(void);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, in
+ * TLBHI_PID. dumbvm uses it so the TLB need not be flushed on every
+ * context switch. TLBLO_GLOBAL makes an entry match whatever the ID;
+ * it is only set on the kernel's own KSEG2 mappings (see kva.c). The
+ * bits that aren't assigned a meaning can be left always zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,14 +106,16 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+#define NUM_TLBPID    64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
 #define TLBLO_NOCACHE 0x00000800
 #define TLBLO_DIRTY   0x00000400
 #define TLBLO_VALID   0x00000200
-/*      TLBLO_GLOBAL  0x00000100 */
+#define TLBLO_GLOBAL  0x00000100
 
 /*
  * Values for completely invalid TLB entries. The TLB entry index should
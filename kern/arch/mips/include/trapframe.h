@@ -106,5 +106,10 @@ void mips_usermode(struct trapframe *tf);
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
 
+/*
+ * Page directories for the fast-path TLB refill, indexed the same way.
+ */
+extern vaddr_t cpupagedirs[];
+
 
 #endif /* _MIPS_TRAPFRAME_H_ */
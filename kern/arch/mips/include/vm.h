@@ -115,9 +115,36 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	/* The address space's TLB tag when the shootdown was sent */
+	uint32_t ts_asid;
+	uint32_t ts_asidgen;
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Kernel virtual memory in KSEG2 (kva.c), for kernel allocations of
+ * more than one page when there is no run of free frames that long.
+ * The pages are scattered frames mapped through the TLB with global
+ * entries, so such memory has no physical address of its own and
+ * must not be passed to KVADDR_TO_PADDR. Nothing that has to be
+ * usable while a TLB miss can't be taken (thread stacks, the page
+ * directories the UTLB handler walks) may live here.
+ *
+ *   kva_alloc: map NPAGES fresh frames; returns the address or 0.
+ *   kva_free:  unmap an allocation and free its frames, once the
+ *        other cpus have dropped their TLB entries for them. It
+ *        waits for that, so call it (and kfree such memory) with no
+ *        spinlocks held.
+ *   kva_fault: load the TLB entry for a kernel miss in KSEG2. Takes
+ *        no locks. Returns EFAULT if VADDR isn't mapped.
+ *
+ * alloc_kpages and free_kpages call these themselves. A shootdown
+ * with no address space (ts_addrspace NULL) is for one of these.
+ */
+vaddr_t kva_alloc(unsigned npages);
+void kva_free(vaddr_t vaddr);
+int kva_fault(vaddr_t vaddr);
+
 
 #endif /* _MIPS_VM_H_ */
@@ -38,6 +38,8 @@
 /*******New for A2 *****************/
 #include <addrspace.h>
 /***********************************/
+#include <copyinout.h>
+#include "opt-A3.h"
 
 /*
  * System call dispatcher.
@@ -83,6 +85,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A3
+	userptr_t path;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -144,6 +150,49 @@ syscall(struct trapframe *tf)
       break;
 #endif
 
+#if OPT_A3
+    case SYS_mmap_path:
+      /* The path and the offset are on the stack, the offset aligned */
+      err = copyin((const_userptr_t)(tf->tf_sp + 16), &path, sizeof(path));
+      if (err) {
+        break;
+      }
+      err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+      if (err) {
+        break;
+      }
+      err = sys_mmap_path((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                          (int)tf->tf_a2, (int)tf->tf_a3, path, offset,
+                          (vaddr_t *)&retval);
+      break;
+    case SYS_pread_path:
+    case SYS_pwrite_path:
+      /* The offset is on the stack, aligned */
+      err = copyin((const_userptr_t)(tf->tf_sp + 16), &offset, sizeof(offset));
+      if (err) {
+        break;
+      }
+      if (callno == SYS_pread_path) {
+        err = sys_pread_path((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+                             (size_t)tf->tf_a2, offset, (int *)&retval);
+      }
+      else {
+        err = sys_pwrite_path((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+                              (size_t)tf->tf_a2, offset, (int *)&retval);
+      }
+      break;
+    case SYS_munmap:
+      err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+      break;
+    case SYS_msync:
+      err = sys_msync((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                      (int)tf->tf_a2);
+      break;
+    case SYS_sbrk:
+      err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+      break;
+#endif
+
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
 	  err = ENOSYS;
@@ -59,6 +59,14 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Page directory of the address space active on each CPU, or 0 if
+ * none, for the fast-path TLB refill in exception-mips1.S. Set by
+ * as_activate() and cleared by as_deactivate(); a VM system without
+ * page tables leaves it 0 and every refill goes to vm_fault.
+ */
+vaddr_t cpupagedirs[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
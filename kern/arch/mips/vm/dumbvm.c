@@ -41,6 +41,14 @@
 #include <syscall.h>
 #include <coremap.h>
 #include <mips/trapframe.h>
+#include <uio.h>
+#include <vnode.h>
+#include <stat.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <swap.h>
+#include <filecache.h>
+#include <uw-vmstats.h>
 #include "opt-A3.h"
  /*********************************/
 
@@ -52,15 +60,27 @@
  * assignment, this file is not included in your kernel!
  */
 
-/* under dumbvm, always have 48k of user stack */
+/*
+ * The stack starts out as 48k and grows down as it is used, up to
+ * DUMBVM_STACKMAX. That must stay below the room MMAP_TOP leaves.
+ */
 #define DUMBVM_STACKPAGES    12
+#define DUMBVM_STACKMAX      (8 * 1024 * 1024)
 
-#ifdef OPT_A3
+/* Most pages vm_fault loads into the TLB besides the one faulted on */
+#define FAULTAROUND_MAX      8
+
+/* mmap places mappings from here down, leaving the stack room below it */
+#define MMAP_TOP             (USERSTACK - 16 * 1024 * 1024)
 
-/* define segment types*/
-#define TEXT_SEGMENT  1
-#define DATA_SEGMENT  2
-#define STACK_SEGMENT 3
+/*
+ * Largest the heap may get. Its pages only come when touched, so
+ * without a limit sbrk would hand out far more than memory and swap
+ * could ever hold.
+ */
+#define HEAP_MAX             (64 * 1024 * 1024)
+
+#ifdef OPT_A3
 
 /*
    0 ----- vm has not yet bootstrapped 
@@ -71,6 +91,50 @@ static uint32_t num_of_coremap_pages, num_of_pages;
 static paddr_t firstaddr, lastaddr;
 static struct coremap_entry* coremap;
 
+/*
+ * Free frames are kept by a buddy allocator: blocks of 2^order frames,
+ * aligned to their size (counted in coremap indices), one free list
+ * per order threaded through the coremap entries.
+ */
+#define BUDDY_MAXORDER 10
+#define COREMAP_NONE 0xfffff    /* fits the 20-bit links */
+static uint32_t buddy_freelist[BUDDY_MAXORDER + 1];
+
+/*
+ * Frames zeroed ahead of time by idle cpus (see vm_idle), linked
+ * through the coremap's next field. To the coremap they are allocated
+ * frames with no owner. The pool is kept small, since its frames are
+ * not free for anything but single-page allocations.
+ */
+#define ZEROPOOL_MAX 64
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static uint32_t zeropool_head = COREMAP_NONE;
+static unsigned zeropool_count, zeropool_max;
+
+/*
+ * The zero page. Every page of a writeable region that has been read
+ * but never written maps this one frame copy-on-write; the first
+ * write gets a frame of its own. It holds a reference of its own, so
+ * it is never freed, nor evicted.
+ */
+static paddr_t zero_frame;
+
+/*
+ * Address space IDs. IDs are handed out in generations; once all
+ * NUM_TLBPID-1 of them are used up (0 is left for the kernel), a new
+ * generation starts and every ID handed out before is stale. A cpu
+ * flushes its TLB the first time it runs something from a newer
+ * generation than the one its TLB contents came from.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_next = 1;
+static uint32_t asid_gen = 1;
+
+/* Next frame the page replacement clock looks at */
+static uint32_t clock_hand;
+/* Faults on a page that is being evicted sleep here until it is gone */
+static struct wchan *evict_wchan;
+
 #endif
 
 /*
@@ -79,6 +143,48 @@ static struct coremap_entry* coremap;
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 
+#ifdef OPT_A3
+
+/*
+ * How often coremap_lock is taken, and how often some other cpu was
+ * holding it at the time. Only updated with the lock held.
+ */
+static unsigned coremap_lock_acquires;
+static unsigned coremap_lock_contended;
+
+static
+void
+coremap_lock_acquire(void)
+{
+    /* Peeking at the lock word is only good enough for statistics */
+    bool busy = spinlock_data_get(&coremap_lock.lk_lock) != 0;
+
+    spinlock_acquire(&coremap_lock);
+    coremap_lock_acquires++;
+    if (busy) {
+        coremap_lock_contended++;
+    }
+}
+
+static
+void
+coremap_lock_release(void)
+{
+    spinlock_release(&coremap_lock);
+}
+
+void
+coremap_printstats(void)
+{
+    kprintf("coremap lock: %u acquires, %u contended\n",
+            coremap_lock_acquires, coremap_lock_contended);
+}
+
+static void buddy_free_range(uint32_t start, uint32_t npages);
+static paddr_t getppages(unsigned long npages);
+
+#endif
+
 void
 vm_bootstrap(void)
 {
@@ -86,7 +192,7 @@ vm_bootstrap(void)
     
     unsigned long coremap_size;
 
-    spinlock_acquire(&coremap_lock);
+    coremap_lock_acquire();
 
     ram_getsize(&firstaddr, &lastaddr);
 
@@ -96,6 +202,10 @@ vm_bootstrap(void)
     /* Calculate the number of frames available */
     num_of_pages = (lastaddr - firstaddr) / PAGE_SIZE;
 
+    /* The entries are packed; see coremap.h */
+    COMPILE_ASSERT(sizeof(struct coremap_entry) == 16);
+    KASSERT(num_of_pages < COREMAP_NONE);
+
     /* Calculate the size of the core map */
     coremap_size = num_of_pages * sizeof(struct coremap_entry);
 
@@ -109,107 +219,528 @@ vm_bootstrap(void)
         if(i < num_of_coremap_pages) {
             coremap[i].used = 1;
             coremap[i].count = 1;
+            coremap[i].refcount = 1;
         }
         else {
             coremap[i].used = 0;
             coremap[i].count = 0;
+            coremap[i].refcount = 0;
         }
+        coremap[i].next = COREMAP_NONE;
+        coremap[i].as = NULL;
+        coremap[i].vpn = 0;
+        coremap[i].referenced = 0;
+        coremap[i].kmclass = 0;
+    }
+
+    // Hand everything after the coremap to the buddy allocator
+    for(uint32_t i = 0; i <= BUDDY_MAXORDER; i++) {
+        buddy_freelist[i] = COREMAP_NONE;
+    }
+    buddy_free_range(num_of_coremap_pages, num_of_pages - num_of_coremap_pages);
+
+    // Let the idle cpus keep a few zeroed pages around
+    zeropool_max = (num_of_pages - num_of_coremap_pages) / 32;
+    if(zeropool_max > ZEROPOOL_MAX) {
+        zeropool_max = ZEROPOOL_MAX;
     }
+
+    clock_hand = num_of_coremap_pages;
     
     // vm finished bootstrapping !
     vm_bootstrap_flag = 1;
 
-    spinlock_release(&coremap_lock);
+    coremap_lock_release();
+
+    evict_wchan = wchan_create("evict");
+    if (evict_wchan == NULL) {
+        panic("dumbvm: cannot create the eviction wait channel\n");
+    }
+
+    zero_frame = getppages(1);
+    if (zero_frame == 0) {
+        panic("dumbvm: no memory for the zero page\n");
+    }
+    bzero((void *)PADDR_TO_KVADDR(zero_frame), PAGE_SIZE);
+
+    /* Also checks that every counter has a name */
+    vmstats_init();
+
+    /* Pages can be paged out from now on */
+    filecache_bootstrap();
+    swap_bootstrap();
 
     #endif
 }
 
 #ifdef OPT_A3
 
+/* Put the free block of 2^ORDER frames at index I on its free list */
+static
+void
+buddy_push(uint32_t i, unsigned order) {
+    uint32_t head = buddy_freelist[order];
+
+    coremap[i].used = 0;
+    coremap[i].count = 1UL << order;
+    coremap[i].prev = COREMAP_NONE;
+    coremap[i].next = head;
+    if(head != COREMAP_NONE) {
+        coremap[head].prev = i;
+    }
+    buddy_freelist[order] = i;
+}
+
+/* Take the free block at index I off its free list */
+static
+void
+buddy_remove(uint32_t i, unsigned order) {
+    if(coremap[i].prev != COREMAP_NONE) {
+        coremap[coremap[i].prev].next = coremap[i].next;
+    }
+    else {
+        buddy_freelist[order] = coremap[i].next;
+    }
+    if(coremap[i].next != COREMAP_NONE) {
+        coremap[coremap[i].next].prev = coremap[i].prev;
+    }
+    coremap[i].count = 0;
+    coremap[i].next = COREMAP_NONE;
+    coremap[i].prev = COREMAP_NONE;
+}
+
+/*
+ * Free the block of 2^ORDER frames at index I, merging it with its
+ * buddy for as long as the buddy is free and of the same size.
+ */
 static
-struct pagetable_entry* 
-pagetable_alloc(size_t npages) {
-   struct pagetable_entry* page_table;
-   unsigned long page_table_size;
-   unsigned long page_table_pages;
+void
+buddy_free_block(uint32_t i, unsigned order) {
+    uint32_t buddy, size;
 
-   /* Calculate the size of the page table */
-   page_table_size = npages * sizeof(struct pagetable_entry);
+    while(order < BUDDY_MAXORDER) {
+        size = 1U << order;
+        buddy = i ^ size;
+        if(buddy < num_of_coremap_pages || buddy + size > num_of_pages) {
+            break;
+        }
+        if(coremap[buddy].used || coremap[buddy].count != size) {
+            break;
+        }
+        buddy_remove(buddy, order);
+        i &= ~size;
+        order++;
+    }
+    buddy_push(i, order);
+}
 
-   /* Calculate how many pages should be used by page table. It's better to round up*/
-   page_table_pages = ROUNDUP(page_table_size, PAGE_SIZE) / PAGE_SIZE;
+/*
+ * Free NPAGES frames starting at index START, which need not be a
+ * buddy block, by cutting the range into the largest aligned blocks
+ * that fit.
+ */
+static
+void
+buddy_free_range(uint32_t start, uint32_t npages) {
+    unsigned order;
+
+    while(npages > 0) {
+        order = 0;
+        while(order < BUDDY_MAXORDER &&
+              (start & ((2U << order) - 1)) == 0 &&
+              (2U << order) <= npages) {
+            order++;
+        }
+        buddy_free_block(start, order);
+        start += 1U << order;
+        npages -= 1U << order;
+    }
+}
 
-   /* Now we allocate space for the page table by using alloc_kpages */
-   page_table = (struct pagetable_entry *)alloc_kpages(page_table_pages);
+/*
+ * Allocate NPAGES contiguous frames from the buddy lists and return
+ * the index of the first one, or COREMAP_NONE. They come out of the
+ * smallest free block that is big enough, splitting larger ones as
+ * needed; the part of the block beyond NPAGES goes straight back.
+ * Call with coremap_lock held.
+ */
+static
+uint32_t
+buddy_alloc(unsigned long npages) {
+    unsigned order, k;
+    uint32_t start;
+
+    order = 0;
+    while((1UL << order) < npages) {
+        order++;
+    }
+    if(order > BUDDY_MAXORDER) {
+        return COREMAP_NONE;
+    }
 
-   if(page_table == 0) {
-         return 0;
-   }
-   return page_table;
+    for(k = order; k <= BUDDY_MAXORDER; k++) {
+        if(buddy_freelist[k] != COREMAP_NONE) {
+            break;
+        }
+    }
+    if(k > BUDDY_MAXORDER) {
+       return COREMAP_NONE;
+    }
+
+    start = buddy_freelist[k];
+    buddy_remove(start, k);
+
+    /* Split off the upper halves until the block is just big enough */
+    while(k > order) {
+        k--;
+        buddy_push(start + (1U << k), k);
+    }
+
+    /* Start filling in the coremap entries */
+    coremap[start].used = 1;
+    coremap[start].count = npages;
+    coremap[start].refcount = 1;
+    for(uint32_t j = start + 1 ; j < start + npages; j++) {
+        coremap[j].used = 1;
+        coremap[j].count = 1;
+    }
+    /* End filling in the coremap entries */
+
+    /* Don't waste the rest of a power-of-two block on odd sizes */
+    if((1UL << order) > npages) {
+        buddy_free_range(start + npages, (1U << order) - npages);
+    }
+
+    return start;
+}
+
+/* Give the allocation at index START back. Call with coremap_lock held */
+static
+void
+buddy_dealloc(uint32_t start) {
+    uint32_t npages = coremap[start].count;
+
+    for(uint32_t i = start; i < start + npages; i++) {
+        coremap[i].used = 0;
+        coremap[i].count = 0;
+        coremap[i].as = NULL;
+    }
+    buddy_free_range(start, npages);
+}
+
+/*
+ * Drop a reference to the allocation at index START, and free it if
+ * that was the last one. Call with coremap_lock held.
+ */
+static
+void
+coremap_putref(uint32_t start) {
+    KASSERT(coremap[start].used && coremap[start].refcount > 0);
+
+    if(--coremap[start].refcount == 0) {
+        buddy_dealloc(start);
+    }
+}
+
+/*
+ * Batched single-frame allocation and free: N frames under one
+ * acquisition of coremap_lock instead of one each.
+ *
+ * coremap_alloc_batch puts up to N fresh frames in PAS and returns
+ * how many it got. coremap_free_batch drops a reference to each of
+ * the N frames in PAS, freeing those nobody else holds.
+ */
+static
+unsigned
+coremap_alloc_batch(paddr_t *pas, unsigned n) {
+    uint32_t i;
+    unsigned got;
+
+    coremap_lock_acquire();
+    for(got = 0; got < n; got++) {
+        i = buddy_alloc(1);
+        if(i == COREMAP_NONE) {
+            break;
+        }
+        pas[got] = firstaddr + i * PAGE_SIZE;
+    }
+    coremap_lock_release();
+
+    return got;
+}
+
+static
+void
+coremap_free_batch(const paddr_t *pas, unsigned n) {
+    coremap_lock_acquire();
+    for(unsigned k = 0; k < n; k++) {
+        coremap_putref((pas[k] - firstaddr) / PAGE_SIZE);
+    }
+    coremap_lock_release();
+}
+
+/*
+ * Per-cpu page caches.
+ *
+ * Each cpu keeps a few free frames of its own in c_pagecache, so that
+ * single-page allocations and frees normally never touch coremap_lock.
+ * The cache is refilled and drained PAGECACHE_BATCH frames at a time.
+ * As far as the coremap is concerned a cached frame is allocated, with
+ * no owner; it is only ever touched by its cpu, with interrupts off.
+ */
+#define PAGECACHE_BATCH (CPU_PAGECACHE_MAX / 2)
+
+/* Give COUNT frames from the cache of C back to the buddy allocator */
+static
+void
+pagecache_drain(struct cpu *c, unsigned count) {
+    if(count > c->c_npagecache) {
+        count = c->c_npagecache;
+    }
+    c->c_npagecache -= count;
+    coremap_free_batch(&c->c_pagecache[c->c_npagecache], count);
+}
+
+static
+paddr_t
+pagecache_get(void) {
+    struct cpu *c;
+    paddr_t pa;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+
+    if(c->c_npagecache == 0) {
+        c->c_npagecache = coremap_alloc_batch(c->c_pagecache,
+                                              PAGECACHE_BATCH);
+    }
+
+    pa = 0;
+    if(c->c_npagecache > 0) {
+        pa = c->c_pagecache[--c->c_npagecache];
+    }
+
+    splx(spl);
+    return pa;
+}
+
+static
+void
+pagecache_put(paddr_t pa) {
+    struct cpu *c;
+    int spl;
+
+    spl = splhigh();
+    c = curcpu->c_self;
+
+    if(c->c_npagecache == CPU_PAGECACHE_MAX) {
+        pagecache_drain(c, PAGECACHE_BATCH);
+    }
+    c->c_pagecache[c->c_npagecache++] = pa;
+
+    splx(spl);
 }
 
 static
 void 
 coremap_dealloc(paddr_t pa) {
 
-    spinlock_acquire(&coremap_lock);
+    /* Memory stolen before the coremap existed is never given back */
+    if(pa < firstaddr) {
+        return;
+    }
 
     uint32_t start = ( pa - firstaddr ) / PAGE_SIZE;
-    uint32_t end = start + coremap[start].count;
-    for(uint32_t i = start; i < end; i++) {
-        coremap[i].used = 0;
-        coremap[i].count = 0;
+    KASSERT(coremap[start].used && coremap[start].refcount > 0);
+
+    /*
+     * A single page nobody else holds a reference to: nobody else
+     * can take one either, so no lock is needed to park it in this
+     * cpu's cache.
+     */
+    if(coremap[start].count == 1 && coremap[start].refcount == 1) {
+        coremap[start].as = NULL;
+        pagecache_put(pa);
+        return;
+    }
+
+    /* Otherwise it may still be shared; just drop our reference */
+    coremap_lock_acquire();
+    coremap_putref(start);
+    coremap_lock_release();
+}
+
+/* Number of owners of the allocation starting at PA */
+unsigned long
+coremap_getref(paddr_t pa) {
+    unsigned long refcount;
+
+    coremap_lock_acquire();
+
+    uint32_t start = ( pa - firstaddr ) / PAGE_SIZE;
+    refcount = coremap[start].refcount;
+
+    coremap_lock_release();
+
+    return refcount;
+}
+
+/* One more owner for the allocation starting at PA */
+void
+coremap_incref(paddr_t pa) {
+    coremap_lock_acquire();
+
+    uint32_t start = ( pa - firstaddr ) / PAGE_SIZE;
+    KASSERT(coremap[start].used && coremap[start].refcount > 0);
+    coremap[start].refcount++;
+
+    coremap_lock_release();
+}
+
+/*
+ * The tag is only written by whoever owns the page, so it needs no
+ * lock; nothing else in the entry's words changes while a page is
+ * allocated to the kernel.
+ */
+void
+coremap_setkmtag(vaddr_t kvaddr, unsigned kmclass, unsigned kmref) {
+    struct coremap_entry *cme;
+
+    if(!vm_bootstrap_flag || kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1 ||
+       KVADDR_TO_PADDR(kvaddr) < firstaddr) {
+        return;
+    }
+    KASSERT(kmref <= COREMAP_NONE);
+    cme = &coremap[(KVADDR_TO_PADDR(kvaddr) - firstaddr) / PAGE_SIZE];
+    KASSERT(cme->used && cme->as == NULL);
+    cme->kmclass = kmclass;
+    cme->vpn = kmref;
+}
+
+bool
+coremap_getkmtag(vaddr_t kvaddr, unsigned *kmclass, unsigned *kmref) {
+    struct coremap_entry *cme;
+
+    *kmclass = 0;
+    *kmref = 0;
+    if(kvaddr < MIPS_KSEG0 || kvaddr >= MIPS_KSEG1) {
+        /* Not a page kmalloc could have split up */
+        return true;
+    }
+    if(!vm_bootstrap_flag || KVADDR_TO_PADDR(kvaddr) < firstaddr) {
+        return false;
+    }
+    cme = &coremap[(KVADDR_TO_PADDR(kvaddr) - firstaddr) / PAGE_SIZE];
+    *kmclass = cme->kmclass;
+    *kmref = cme->vpn;
+    return true;
+}
+
+/* Take a zeroed frame out of the pool, or return 0 if it is empty */
+static
+paddr_t
+zeropool_get(void) {
+    uint32_t i;
+
+    spinlock_acquire(&zeropool_lock);
+    i = zeropool_head;
+    if(i == COREMAP_NONE) {
+        spinlock_release(&zeropool_lock);
+        return 0;
+    }
+    zeropool_head = coremap[i].next;
+    coremap[i].next = COREMAP_NONE;
+    zeropool_count--;
+    spinlock_release(&zeropool_lock);
+
+    return firstaddr + i * PAGE_SIZE;
+}
+
+/* Add the zeroed frame PA to the pool. Returns 0 if the pool is full */
+static
+int
+zeropool_put(paddr_t pa) {
+    uint32_t i = (pa - firstaddr) / PAGE_SIZE;
+
+    spinlock_acquire(&zeropool_lock);
+    if(zeropool_count >= zeropool_max) {
+        spinlock_release(&zeropool_lock);
+        return 0;
+    }
+    coremap[i].next = zeropool_head;
+    zeropool_head = i;
+    zeropool_count++;
+    spinlock_release(&zeropool_lock);
+
+    return 1;
+}
+
+/* Give every frame in the pool back */
+static
+void
+zeropool_flush(void) {
+    uint32_t i, next;
+
+    spinlock_acquire(&zeropool_lock);
+    i = zeropool_head;
+    zeropool_head = COREMAP_NONE;
+    zeropool_count = 0;
+    spinlock_release(&zeropool_lock);
+
+    while(i != COREMAP_NONE) {
+        next = coremap[i].next;
+        coremap[i].next = COREMAP_NONE;
+        coremap_dealloc(firstaddr + i * PAGE_SIZE);
+        i = next;
     }
-    
-    spinlock_release(&coremap_lock);
 }
 
 static
 paddr_t
 coremap_alloc(unsigned long npages) {
-    paddr_t addr;
-    int successful = 0;
-    uint32_t length = 0;
-    uint32_t start = 0;
+    uint32_t start;
+    int spl;
 
-    spinlock_acquire(&coremap_lock);
+    if(npages == 1) {
+        return pagecache_get();
+    }
 
-    for(uint32_t i = num_of_coremap_pages; i < num_of_pages; i++) {
-        if(coremap[i].used == 0) {
-            ++length;
-            /* We have found a sequence of free frames */
-            if(length == npages) {
-               successful = 1;
-               start = i - length + 1;
-
-               /* Start filling in the coremap entries */
-               coremap[start].used = 1;
-               coremap[start].count = npages;
-               for(uint32_t j = start + 1 ; j <= i; j++) {
-                   coremap[j].used = 1;
-                   coremap[j].count = 1;
-               }
-               /* End filling in the coremap entries */
+    coremap_lock_acquire();
+    start = buddy_alloc(npages);
+    coremap_lock_release();
 
-               addr = firstaddr + start * PAGE_SIZE;
-               break;
-            }
-        }
-        else {
-            length = 0;
+    if(start == COREMAP_NONE) {
+        /*
+         * The zero pool and our own cached frames might be what is
+         * missing; try again without them.
+         */
+        zeropool_flush();
+        spl = splhigh();
+        pagecache_drain(curcpu->c_self, CPU_PAGECACHE_MAX);
+        splx(spl);
+
+        coremap_lock_acquire();
+        start = buddy_alloc(npages);
+        coremap_lock_release();
+
+        if(start == COREMAP_NONE) {
+            return 0;
         }
     }
-    if(!successful) {
-       spinlock_release(&coremap_lock);
-       return 0;
-    }
-    spinlock_release(&coremap_lock);
 
-    return addr;
+    return firstaddr + start * PAGE_SIZE;
 }
 
 #endif
 
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+    bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
 static
 paddr_t
 getppages(unsigned long npages)
@@ -219,7 +750,7 @@ getppages(unsigned long npages)
     #if OPT_A3
     
     // Need to call coremap_alloc here. !important
-    // as_prepare_load will call getppages directly instead of alloc_kpages
+    // vm_fault will call getppages directly instead of alloc_kpages
     if(vm_bootstrap_flag) {
         addr = coremap_alloc(npages);
     }
@@ -245,16 +776,37 @@ getppages(unsigned long npages)
 }
 
 /* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+vaddr_t
+alloc_kpages_contig(int npages)
 {
     paddr_t pa;
 
     pa = getppages(npages);
-    if (pa==0) {
+    #if OPT_A3
+    if (pa==0 && vm_bootstrap_flag && filecache_reclaim() > 0) {
+        /* Cached file pages nobody maps are ours for the asking */
+        pa = getppages(npages);
+    }
+    #endif
+    if (pa==0) {
         return 0;
     }
     return PADDR_TO_KVADDR(pa);
+}
+
+vaddr_t 
+alloc_kpages(int npages)
+{
+    vaddr_t va;
+
+    va = alloc_kpages_contig(npages);
+    #if OPT_A3
+    if (va==0 && npages > 1 && vm_bootstrap_flag) {
+        /* No run of frames that long; map scattered ones instead */
+        return kva_alloc(npages);
+    }
+    #endif
+    return va;
 
 }
 
@@ -264,6 +816,12 @@ free_kpages(vaddr_t addr)
     #if OPT_A3
 
     paddr_t pa;
+
+    if (addr >= MIPS_KSEG2) {
+        kva_free(addr);
+        return;
+    }
+
     pa = KVADDR_TO_PADDR(addr);
     coremap_dealloc(pa);
 
@@ -276,28 +834,1149 @@ free_kpages(vaddr_t addr)
     #endif
 }
 
+int
+vm_idle(void)
+{
+    #if OPT_A3
+
+    paddr_t pa;
+
+    /* Unlocked peek; at worst we zero one page too many */
+    if(!vm_bootstrap_flag || zeropool_count >= zeropool_max) {
+        return 0;
+    }
+
+    pa = getppages(1);
+    if(pa == 0) {
+        return 0;
+    }
+    as_zero_region(pa, 1);
+
+    if(!zeropool_put(pa)) {
+        free_kpages(PADDR_TO_KVADDR(pa));
+        return 0;
+    }
+    return 1;
+
+    #else
+
+    return 0;
+
+    #endif
+}
+
 void
 vm_tlbshootdown_all(void)
 {
+    #if OPT_A3
+
+    int i, spl;
+
+    spl = splhigh();
+    for (i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_flushed();
+    vmstats_inc(VMSTAT_TLB_INVALIDATE);
+    splx(spl);
+
+    #else
+
     panic("dumbvm tried to do tlb shootdown?!\n");
+
+    #endif
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+    #if OPT_A3
+
+    int i, spl;
+
+    /*
+     * Runs from the IPI handler, so it must not take coremap_lock.
+     * Entries are left behind by every address space that ran here,
+     * not just the current one; but if our TLB is from another ID
+     * generation, none of them can carry the ID in question. Kernel
+     * KSEG2 entries are global and match any ID.
+     */
+    spl = splhigh();
+    if (ts->ts_addrspace == NULL) {
+        i = tlb_probe(ts->ts_vaddr, 0);
+        if (i >= 0) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    else if (ts->ts_asidgen == curcpu->c_asidgen) {
+        i = tlb_probe(ts->ts_vaddr | (ts->ts_asid << TLBHI_PIDSHIFT), 0);
+        if (i >= 0) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+    }
+    splx(spl);
+
+    #else
+
     (void)ts;
     panic("dumbvm tried to do tlb shootdown?!\n");
+
+    #endif
+}
+
+#if OPT_A3
+
+static pte_t *pt_lookup(struct addrspace *as, vaddr_t vaddr, int create);
+
+/*
+ * Forget every TLB entry of AS, on every cpu, by giving it a new ID
+ * the next time it is activated. If AS is running here, that is now.
+ */
+static
+void
+as_tlbflush(struct addrspace *as)
+{
+    spinlock_acquire(&asid_lock);
+    as->as_asidgen = 0;
+    spinlock_release(&asid_lock);
+
+    if (as == curproc_getas()) {
+        as_activate();
+    }
+}
+
+/* The region of AS that VADDR falls in, or NULL */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *rg;
+
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (vaddr >= rg->rg_vbase &&
+            vaddr - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+            return rg;
+        }
+    }
+    return NULL;
+}
+
+/* Whether no region of AS overlaps the SZ bytes at VADDR */
+static
+bool
+as_range_free(struct addrspace *as, vaddr_t vaddr, size_t sz)
+{
+    struct region *rg;
+
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+            rg->rg_vbase < vaddr + sz) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Extend the stack of AS down to the page VADDR is on, if that is
+ * within DUMBVM_STACKMAX of the top and nothing else is in the way.
+ * Returns the stack, or NULL.
+ */
+static
+struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *rg;
+
+    rg = as->as_stack;
+    if (rg == NULL || vaddr >= rg->rg_vbase ||
+        vaddr < USERSTACK - DUMBVM_STACKMAX) {
+        return NULL;
+    }
+
+    vaddr &= PAGE_FRAME;
+    if (!as_range_free(as, vaddr, rg->rg_vbase - vaddr)) {
+        return NULL;
+    }
+
+    /* page_evict looks regions up with just the coremap lock held */
+    coremap_lock_acquire();
+    rg->rg_npages += (rg->rg_vbase - vaddr) / PAGE_SIZE;
+    rg->rg_vbase = vaddr;
+    rg->rg_filevaddr = vaddr;
+    coremap_lock_release();
+
+    return rg;
+}
+
+/*
+ * Drop the TLB entry for VADDR in AS here only, and fill in TS for
+ * sending to the other cpus later. TS doesn't need AS to stay around.
+ */
+static
+void
+vm_tlbinvalidate_local(struct addrspace *as, vaddr_t vaddr,
+                       struct tlbshootdown *ts)
+{
+    ts->ts_addrspace = as;
+    ts->ts_vaddr = vaddr;
+
+    spinlock_acquire(&asid_lock);
+    ts->ts_asid = as->as_asid;
+    ts->ts_asidgen = as->as_asidgen;
+    spinlock_release(&asid_lock);
+
+    vm_tlbshootdown(ts);
+}
+
+/*
+ * Drop the TLB entry for VADDR in AS wherever it might be: here, or
+ * on any other cpu AS has run on. The other cpus are only sent an
+ * IPI and do the work when they take it; before the frame is written
+ * out or reused, ipi_tlbshootdown_wait for them, or a store through a
+ * stale entry could still land in it.
+ */
+static
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+
+    vm_tlbinvalidate_local(as, vaddr, &ts);
+    ipi_tlbshootdown_broadcast(&ts);
+}
+
+/*
+ * Wait until PTE is no longer being evicted. Call without holding
+ * coremap_lock. The wchan is locked before coremap_lock is checked,
+ * so the evictor cannot slip its wakeup in between.
+ */
+static
+void
+pagetable_wait(pte_t *pte)
+{
+    wchan_lock(evict_wchan);
+    coremap_lock_acquire();
+    if (!(*pte & PTE_BUSY)) {
+        coremap_lock_release();
+        wchan_unlock(evict_wchan);
+        return;
+    }
+    coremap_lock_release();
+    wchan_sleep(evict_wchan);
+}
+
+/* Send the NSD shootdowns page_evict collected in SD to the other cpus */
+static
+void
+page_evict_shootdown(const struct tlbshootdown *sd, unsigned nsd)
+{
+    unsigned i;
+
+    if (nsd > TLBSHOOTDOWN_MAX) {
+        ipi_tlbflush_broadcast();
+        return;
+    }
+    for (i = 0; i < nsd; i++) {
+        ipi_tlbshootdown_broadcast(&sd[i]);
+    }
+}
+
+/*
+ * Pick a victim with the clock (second chance) algorithm and page it
+ * out. Only user pages with a single owner are considered; a page
+ * that has been used since the hand last passed loses its reference
+ * bit (and its TLB entry, so the next use sets the bit again) and is
+ * skipped this time round.
+ *
+ * Pages of read-only regions are clean copies of the executable (or
+ * the mapped file) and are just dropped, as are pages not written
+ * since they came in from swap, whose slot still has them; everything
+ * else is written to swap. Returns the freed frame, still allocated,
+ * or 0 if nothing could be evicted.
+ */
+static
+paddr_t
+page_evict(void)
+{
+    struct coremap_entry *cme;
+    struct region *rg;
+    struct addrspace *as;
+    struct tlbshootdown sd[TLBSHOOTDOWN_MAX], overflow;
+    pte_t *pte, saved;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    uint32_t i, victim;
+    unsigned slot, nsd;
+    int result;
+
+    /*
+     * The other cpus are told about the entries dropped in one go,
+     * once coremap_lock is released: a cpu spinning for the lock can't
+     * take IPIs, and one for each page would soon overflow its queue.
+     * Past TLBSHOOTDOWN_MAX entries they might as well flush the lot.
+     */
+    nsd = 0;
+
+    coremap_lock_acquire();
+
+    /* Two full sweeps; the first one may only clear reference bits */
+    victim = num_of_pages;
+    for (i = 0; i < 2 * (num_of_pages - num_of_coremap_pages); i++) {
+        cme = &coremap[clock_hand];
+        if (cme->as != NULL && cme->refcount == 1) {
+            if (cme->referenced) {
+                /*
+                 * The TLB refill fast path doesn't set the bit, so
+                 * make the next touch go through vm_fault to do it.
+                 */
+                cme->referenced = 0;
+                pte = pt_lookup(cme->as, cme->vpn * PAGE_SIZE, 0);
+                KASSERT(pte != NULL);
+                *pte &= ~TLBLO_VALID;
+                vm_tlbinvalidate_local(cme->as, cme->vpn * PAGE_SIZE,
+                    nsd < TLBSHOOTDOWN_MAX ? &sd[nsd] : &overflow);
+                nsd++;
+            }
+            else {
+                victim = clock_hand;
+            }
+        }
+        if (++clock_hand == num_of_pages) {
+            clock_hand = num_of_coremap_pages;
+        }
+        if (victim != num_of_pages) {
+            break;
+        }
+    }
+    if (victim == num_of_pages) {
+        coremap_lock_release();
+        page_evict_shootdown(sd, nsd);
+        return 0;
+    }
+
+    cme = &coremap[victim];
+    paddr = firstaddr + victim * PAGE_SIZE;
+    as = cme->as;
+    vaddr = cme->vpn * PAGE_SIZE;
+    rg = as_find_region(as, vaddr);
+    pte = pt_lookup(as, vaddr, 0);
+    KASSERT(rg != NULL && pte != NULL);
+    KASSERT(PTE_RESIDENT(*pte) && PTE_PADDR(*pte) == paddr);
+    KASSERT(!(*pte & PTE_BUSY));
+
+    /* Nobody may use or evict the page while it is written out */
+    saved = *pte;
+    *pte = (saved | PTE_BUSY) & ~(TLBLO_VALID | TLBLO_DIRTY);
+    cme->as = NULL;
+    vm_tlbinvalidate_local(as, vaddr,
+        nsd < TLBSHOOTDOWN_MAX ? &sd[nsd] : &overflow);
+    nsd++;
+
+    coremap_lock_release();
+
+    /* No other cpu may write the page from here on */
+    page_evict_shootdown(sd, nsd);
+    ipi_tlbshootdown_wait();
+
+    if (!rg->rg_writeable) {
+        /* Read back in from the executable next time */
+        result = 0;
+    }
+    else if (saved & PTE_SWAPCOPY) {
+        /* Not written since it came back in; swap has it already */
+        slot = cme->next;
+        result = 0;
+    }
+    else {
+        result = swap_out(paddr, &slot);
+    }
+
+    coremap_lock_acquire();
+    if (result) {
+        /* Swap is full (or broken); the page stays where it is */
+        *pte = saved;
+        cme->as = as;
+    }
+    else if (!rg->rg_writeable) {
+        *pte = 0;
+    }
+    else {
+        *pte = PTE_MKSWAP(slot);
+    }
+    coremap_lock_release();
+
+    wchan_wakeall(evict_wchan);
+
+    return result ? 0 : paddr;
+}
+
+/* Get a frame for a user page, evicting somebody if memory is full */
+static
+paddr_t
+user_page_alloc(void)
+{
+    paddr_t paddr;
+
+    paddr = getppages(1);
+    if (paddr == 0) {
+        /* Zeroed frames are frames too */
+        paddr = zeropool_get();
+    }
+    if (paddr == 0 && filecache_reclaim() > 0) {
+        /* Text nobody runs any more */
+        paddr = getppages(1);
+    }
+    if (paddr == 0) {
+        paddr = page_evict();
+    }
+    return paddr;
 }
 
+/* Same, but the frame comes zero-filled */
+static
+paddr_t
+user_page_alloc_zeroed(void)
+{
+    paddr_t paddr;
+
+    /* Use a page the idle loop already zeroed if there is one */
+    paddr = zeropool_get();
+    if (paddr == 0) {
+        paddr = user_page_alloc();
+        if (paddr == 0) {
+            return 0;
+        }
+        as_zero_region(paddr, 1);
+    }
+    return paddr;
+}
+
+/*
+ * Find the page table entry for VADDR in AS. If the second-level
+ * table is missing it is allocated when CREATE is set; otherwise, or
+ * if that fails, returns NULL.
+ */
+static
+pte_t *
+pt_lookup(struct addrspace *as, vaddr_t vaddr, int create)
+{
+    pte_t *table;
+    paddr_t paddr;
+
+    KASSERT(vaddr < USERSPACETOP);
+
+    table = as->as_pagedir[PT_L1_INDEX(vaddr)];
+    if (table == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        paddr = user_page_alloc_zeroed();
+        if (paddr == 0) {
+            return NULL;
+        }
+        table = (pte_t *)PADDR_TO_KVADDR(paddr);
+        as->as_pagedir[PT_L1_INDEX(vaddr)] = table;
+    }
+    return &table[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Map VADDR in AS to the private frame PADDR and make it evictable.
+ * WRITEABLE says whether the page may be written. Call with
+ * coremap_lock held.
+ */
+static
+void
+pagetable_set(struct addrspace *as, vaddr_t vaddr, pte_t *pte,
+              paddr_t paddr, int writeable)
+{
+    struct coremap_entry *cme;
+
+    cme = &coremap[(paddr - firstaddr) / PAGE_SIZE];
+    KASSERT(cme->used && cme->refcount == 1 && cme->as == NULL);
+
+    *pte = paddr | TLBLO_VALID | (writeable ? TLBLO_DIRTY : 0);
+    cme->as = as;
+    cme->vpn = vaddr / PAGE_SIZE;
+    cme->referenced = 1;
+}
+
+/* Same, taking coremap_lock */
+static
+void
+pagetable_install(struct addrspace *as, vaddr_t vaddr, pte_t *pte,
+                  paddr_t paddr, int writeable)
+{
+    coremap_lock_acquire();
+    pagetable_set(as, vaddr, pte, paddr, writeable);
+    coremap_lock_release();
+}
+
+/* Bring the page at VADDR back in from swap */
+static
+int
+as_swapin_page(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+               pte_t *pte)
+{
+    paddr_t paddr;
+    unsigned slot;
+    int result;
+
+    KASSERT(*pte & PTE_SWAPPED);
+
+    paddr = user_page_alloc();
+    if (paddr == 0) {
+        return ENOMEM;
+    }
+
+    slot = PTE_SWAPSLOT(*pte);
+    result = swap_in(slot, paddr);
+    if (result) {
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return result;
+    }
+
+    /*
+     * Keep the slot, and the page read-only, until the first write
+     * (see vm_fault); evicting it before then needs no writing out.
+     */
+    coremap_lock_acquire();
+    pagetable_set(as, vaddr, pte, paddr, 0);
+    if (rg->rg_writeable) {
+        *pte |= PTE_SWAPCOPY;
+        coremap[(paddr - firstaddr) / PAGE_SIZE].next = slot;
+    }
+    else {
+        swap_free(slot);
+    }
+    coremap_lock_release();
+
+    vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+    return 0;
+}
+
+/*
+ * Drop AS's reference to the frame at index START, which it maps at
+ * VADDR. A frame fork shared is left alone by the clock until a
+ * single owner is left. That owner is then one of the address spaces
+ * in AS's fork ring, with the frame at the same address, so look for
+ * it there and make the frame evictable again. Frames of shared
+ * mappings stay put. Call with coremap_lock held.
+ */
+static
+void
+pagetable_putref(struct addrspace *as, vaddr_t vaddr, uint32_t start) {
+   struct coremap_entry *cme;
+   struct addrspace *other;
+   pte_t *pte;
+
+   cme = &coremap[start];
+   if(cme->as == as) {
+       /* Keep the clock away from it from now on */
+       cme->as = NULL;
+   }
+   coremap_putref(start);
+   if(!cme->used || cme->refcount != 1 || cme->as != NULL) {
+       return;
+   }
+
+   for(other = as->as_forknext; other != as; other = other->as_forknext) {
+       pte = pt_lookup(other, vaddr, 0);
+       if(pte != NULL && PTE_RESIDENT(*pte) &&
+          PTE_PADDR(*pte) == firstaddr + start * PAGE_SIZE) {
+           if(!(*pte & (PTE_BUSY | PTE_SHARED))) {
+               cme->as = other;
+               cme->vpn = vaddr / PAGE_SIZE;
+               cme->referenced = 1;
+           }
+           return;
+       }
+   }
+}
+
+/*
+ * Give back the frames and swap slots behind entries FROM up to TO of
+ * TABLE, which maps AS from BASE up, and clear them. The whole run
+ * goes under one acquisition of coremap_lock (swap_lock nests inside
+ * it), which is only dropped to wait for a page that is being evicted.
+ */
+static
+void
+pagetable_clear(struct addrspace *as, vaddr_t base, pte_t *table,
+                unsigned from, unsigned to) {
+   pte_t entry;
+   uint32_t start;
+
+   coremap_lock_acquire();
+   for(unsigned j = from; j < to; j++) {
+       /* Nobody else makes an untouched entry non-zero */
+       if(table[j] == 0) {
+           continue;
+       }
+
+       while(table[j] & PTE_BUSY) {
+           coremap_lock_release();
+           pagetable_wait(&table[j]);
+           coremap_lock_acquire();
+       }
+       entry = table[j];
+       table[j] = 0;
+       if(PTE_RESIDENT(entry)) {
+           start = (PTE_PADDR(entry) - firstaddr) / PAGE_SIZE;
+           if(entry & PTE_SWAPCOPY) {
+               swap_free(coremap[start].next);
+           }
+           pagetable_putref(as, base + j * PAGE_SIZE, start);
+       }
+       else if(entry & PTE_SWAPPED) {
+           swap_free(PTE_SWAPSLOT(entry));
+       }
+   }
+   coremap_lock_release();
+}
+
+/*
+ * Free every frame and swap slot AS is using, then the page table
+ * itself.
+ */
+static
+void
+pagetable_free(struct addrspace *as) {
+   pte_t *table;
+
+   if(as->as_pagedir == NULL) {
+         return;
+   }
+
+   for(unsigned i = 0; i < PT_L1_SIZE; i++) {
+       table = as->as_pagedir[i];
+       if(table == NULL) {
+           continue;
+       }
+
+       pagetable_clear(as, (vaddr_t)i << PT_L1_SHIFT, table, 0, PT_L2_SIZE);
+
+       /* Others look through our tables with only the lock held */
+       coremap_lock_acquire();
+       as->as_pagedir[i] = NULL;
+       coremap_lock_release();
+       free_kpages((vaddr_t)table);
+   }
+
+   coremap_lock_acquire();
+   as->as_forkprev->as_forknext = as->as_forknext;
+   as->as_forknext->as_forkprev = as->as_forkprev;
+   coremap_lock_release();
+
+   kfree(as->as_pagedir);
+   as->as_pagedir = NULL;
+}
+
+/*
+ * Free the frames and swap slots behind the pages from VADDR up to
+ * TOP. The page tables themselves stay.
+ */
+static
+void
+pagetable_unmap(struct addrspace *as, vaddr_t vaddr, vaddr_t top) {
+   pte_t *table;
+   vaddr_t end;
+
+   while(vaddr < top) {
+       /* Up to the end of this 4M, i.e. of this second-level table */
+       end = (vaddr | ((1U << PT_L1_SHIFT) - 1)) + 1;
+       if(end > top) {
+           end = top;
+       }
+
+       table = as->as_pagedir[PT_L1_INDEX(vaddr)];
+       if(table != NULL) {
+           pagetable_clear(as, vaddr & ~((1U << PT_L1_SHIFT) - 1), table,
+                           PT_L2_INDEX(vaddr),
+                           PT_L2_INDEX(vaddr) + (end - vaddr) / PAGE_SIZE);
+       }
+       vaddr = end;
+   }
+}
+
+/*
+ * Map every page of region RG that is present in OLD into NEW as
+ * well. Nothing is copied; pages of writeable regions become
+ * copy-on-write on both sides, and the first one to write to such a
+ * page takes a private copy in vm_fault. Pages that are out in swap
+ * are brought back in first. Shared mappings stay shared; the child
+ * starts out with them clean, so it only writes back what it writes.
+ */
+static
+int
+pagetable_share(struct addrspace *old, struct addrspace *new,
+                struct region *rg) {
+   struct coremap_entry *cme;
+   pte_t *oldpte, *newpte, entry;
+   vaddr_t vaddr, top, end;
+   int result;
+
+   vaddr = rg->rg_vbase;
+   top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+   while(vaddr < top) {
+       /* A 4M piece (one second-level table) at a time */
+       end = (vaddr | ((1U << PT_L1_SHIFT) - 1)) + 1;
+       if(end > top) {
+           end = top;
+       }
+
+       oldpte = pt_lookup(old, vaddr, 0);
+       if(oldpte == NULL) {
+           /* Nothing touched in this 4M */
+           vaddr = end;
+           continue;
+       }
+
+       newpte = pt_lookup(new, vaddr, 1);
+       if(newpte == NULL) {
+           return ENOMEM;
+       }
+
+       /* The whole piece goes under one acquisition of the lock */
+       coremap_lock_acquire();
+       for(; vaddr < end; vaddr += PAGE_SIZE, oldpte++, newpte++) {
+           /* Never touched pages are left for the child to fault in itself */
+           if(*oldpte == 0) {
+               continue;
+           }
+
+           while(*oldpte & (PTE_BUSY | PTE_SWAPPED)) {
+               entry = *oldpte;
+               coremap_lock_release();
+               if(entry & PTE_BUSY) {
+                   pagetable_wait(oldpte);
+               }
+               else {
+                   result = as_swapin_page(old, rg, vaddr, oldpte);
+                   if(result) {
+                       return result;
+                   }
+               }
+               coremap_lock_acquire();
+           }
+
+           /* Might have been dropped while we waited */
+           entry = *oldpte;
+           if(PTE_RESIDENT(entry)) {
+               /* Not evicted until it has one owner again */
+               cme = &coremap[(PTE_PADDR(entry) - firstaddr) / PAGE_SIZE];
+               cme->refcount++;
+               cme->as = NULL;
+
+               /* Whoever writes it first gets a copy anyway */
+               if(entry & PTE_SWAPCOPY) {
+                   swap_free(cme->next);
+                   entry &= ~PTE_SWAPCOPY;
+                   *oldpte = entry;
+               }
+
+               if(rg->rg_shared) {
+                   entry &= ~TLBLO_DIRTY;
+               }
+               else if(rg->rg_writeable) {
+                   entry = (entry | PTE_COW) & ~TLBLO_DIRTY;
+                   *oldpte = entry;
+               }
+               *newpte = entry;
+           }
+       }
+       coremap_lock_release();
+   }
+
+   return 0;
+}
+
+/*
+ * Give PTE a private, writeable frame. The shared one is copied unless
+ * everybody else has already let go of it, in which case vm_fault
+ * simply takes it back. Nothing needs copying out of the zero page.
+ * Returns 0 without doing anything if the entry changed since vm_fault
+ * looked at it; vm_fault then starts over.
+ */
+static
+int
+pagetable_unshare(struct addrspace *as, vaddr_t vaddr, pte_t *pte) {
+   pte_t entry;
+   paddr_t paddr;
+
+   coremap_lock_acquire();
+   entry = *pte;
+   coremap_lock_release();
+   if(!(entry & PTE_COW) || (entry & PTE_BUSY) || !PTE_RESIDENT(entry)) {
+       return 0;
+   }
+
+   /* The zero page is never evicted, so the entry stays put */
+   if(PTE_PADDR(entry) == zero_frame) {
+       paddr = user_page_alloc_zeroed();
+       if(paddr == 0) {
+           return ENOMEM;
+       }
+
+       /* Drop our reference to the zero page */
+       free_kpages(PADDR_TO_KVADDR(zero_frame));
+
+       pagetable_install(as, vaddr, pte, paddr, 1);
+       return 0;
+   }
+
+   if(coremap_getref(PTE_PADDR(entry)) == 1) {
+       return 0;
+   }
+
+   paddr = user_page_alloc();
+   if(paddr == 0) {
+       return ENOMEM;
+   }
+   memmove((void *)PADDR_TO_KVADDR(paddr),
+           (const void *)PADDR_TO_KVADDR(PTE_PADDR(entry)),
+           PAGE_SIZE);
+
+   /*
+    * Once the others let go, the frame may be evicted while we copy
+    * it; the copy only counts if the entry is still the same.
+    */
+   coremap_lock_acquire();
+   if(*pte != entry) {
+       coremap_lock_release();
+       free_kpages(PADDR_TO_KVADDR(paddr));
+       return 0;
+   }
+   pagetable_putref(as, vaddr, (PTE_PADDR(entry) - firstaddr) / PAGE_SIZE);
+   pagetable_set(as, vaddr, pte, paddr, 1);
+   coremap_lock_release();
+   return 0;
+}
+
+/*
+ * Bring in a page of region RG that is not in memory and not in swap.
+ * It starts out zeroed; whatever part of the region's file-backed
+ * contents falls inside the page is then read straight from the
+ * executable. A page with nothing from the file that is only being
+ * read maps the zero page instead (copy-on-write if the region is
+ * writeable), so untouched BSS and stack cost neither a frame nor a
+ * bzero until written.
+ */
+static
+int
+as_load_page(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+             pte_t *pte, int faulttype)
+{
+    vaddr_t start, end;
+    paddr_t paddr;
+    struct iovec iov;
+    struct uio u;
+    off_t offset;
+    bool hit;
+    int result;
+
+    KASSERT(*pte == 0);
+
+    /*
+     * Read-only pages laid out in the file the same way as in memory
+     * (as the ELF loader normally arranges) come out of the file
+     * cache, so everybody running the program shares one copy. Only
+     * pages wholly inside the file-backed part of the segment, though:
+     * anywhere else the cached frame has other bytes of the file where
+     * the page must read as zeros, so those get a private copy below.
+     * Shared frames are never evicted; the cache lets go of them
+     * once nobody runs the program any more.
+     */
+    offset = rg->rg_fileoffset + ((off_t)vaddr - (off_t)rg->rg_filevaddr);
+    if (!rg->rg_writeable && rg->rg_filesize > 0 &&
+        offset % PAGE_SIZE == 0 &&
+        vaddr >= rg->rg_filevaddr &&
+        vaddr + PAGE_SIZE <= rg->rg_filevaddr + rg->rg_filesize) {
+        KASSERT(as->as_file != NULL);
+
+        result = filecache_get(as->as_file, offset, &paddr, &hit);
+        if (result == 0) {
+            coremap_lock_acquire();
+            *pte = paddr | TLBLO_VALID;
+            coremap_lock_release();
+
+            if (hit) {
+                /* Already in memory, courtesy of someone else */
+                vmstats_inc(VMSTAT_TLB_RELOAD);
+            }
+            else {
+                vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+                vmstats_inc(VMSTAT_ELF_FILE_READ);
+            }
+            return 0;
+        }
+        /* No memory for the cache; try a private copy */
+    }
+
+    /* Work out which part of this page comes from the file, if any */
+    start = vaddr > rg->rg_filevaddr ? vaddr : rg->rg_filevaddr;
+    end = rg->rg_filevaddr + rg->rg_filesize;
+    if (end > vaddr + PAGE_SIZE) {
+        end = vaddr + PAGE_SIZE;
+    }
+
+    if (faulttype == VM_FAULT_READ && (rg->rg_filesize == 0 || start >= end)) {
+        coremap_incref(zero_frame);
+
+        coremap_lock_acquire();
+        *pte = zero_frame | TLBLO_VALID | (rg->rg_writeable ? PTE_COW : 0);
+        coremap_lock_release();
+
+        vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+        return 0;
+    }
+
+    paddr = user_page_alloc_zeroed();
+    if (paddr == 0) {
+        return ENOMEM;
+    }
+
+    if (rg->rg_filesize > 0 && start < end) {
+        KASSERT(as->as_file != NULL);
+
+        uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr + (start - vaddr)),
+                  end - start, rg->rg_fileoffset + (start - rg->rg_filevaddr),
+                  UIO_READ);
+        result = VOP_READ(as->as_file, &u);
+        if (result) {
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            return result;
+        }
+        if (u.uio_resid != 0) {
+            /* short read; problem with executable? */
+            kprintf("dumbvm: short read on page - file truncated?\n");
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            return ENOEXEC;
+        }
+        vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+        vmstats_inc(VMSTAT_ELF_FILE_READ);
+    }
+    else {
+        vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+    }
+
+    pagetable_install(as, vaddr, pte, paddr, rg->rg_writeable);
+    return 0;
+}
+
+/*
+ * Bring in a page of a region made by mmap. It comes out of the file
+ * cache, so all mappings of the file, and read() and write() too,
+ * share the one frame. A private mapping that may be written gets it
+ * copy-on-write. A shared one gets it read-only until the first
+ * write, so that the page table shows which pages as_syncregion has
+ * to write back.
+ */
+static
+int
+as_load_mapped(struct region *rg, vaddr_t vaddr, pte_t *pte)
+{
+    paddr_t paddr;
+    bool hit;
+    int result;
+
+    KASSERT(*pte == 0);
+
+    result = filecache_get(rg->rg_vnode,
+                           rg->rg_fileoffset + (vaddr - rg->rg_vbase),
+                           &paddr, &hit);
+    if (result) {
+        return result;
+    }
+
+    coremap_lock_acquire();
+    *pte = paddr | TLBLO_VALID;
+    if (rg->rg_shared) {
+        *pte |= PTE_SHARED;
+    }
+    else if (rg->rg_writeable) {
+        *pte |= PTE_COW;
+    }
+    coremap_lock_release();
+
+    if (hit) {
+        vmstats_inc(VMSTAT_TLB_RELOAD);
+    }
+    else {
+        vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+        vmstats_inc(VMSTAT_ELF_FILE_READ);
+    }
+    return 0;
+}
+
+/*
+ * Write the pages of shared mapping RG from START up to END that have
+ * been written to since the last time back to the file. They are
+ * made read-only again first, on every cpu, so a write that comes in
+ * meanwhile is noticed next time. Bytes past the end of the file are not written;
+ * a mapping doesn't make the file any longer.
+ */
+static
+int
+as_syncregion(struct addrspace *as, struct region *rg, vaddr_t start,
+              vaddr_t end)
+{
+    struct stat st;
+    struct iovec iov;
+    struct uio u;
+    pte_t *pte, entry;
+    off_t offset;
+    size_t len;
+    vaddr_t vaddr;
+    int result;
+
+    KASSERT(rg->rg_vnode != NULL && rg->rg_shared);
+
+    result = VOP_STAT(rg->rg_vnode, &st);
+    if (result) {
+        return result;
+    }
+
+    vaddr = start;
+    while (vaddr < end) {
+        pte = pt_lookup(as, vaddr, 0);
+        if (pte == NULL) {
+            /* Nothing touched in this 4M; skip to the next one */
+            vaddr = (vaddr | ((1U << PT_L1_SHIFT) - 1)) + 1;
+            continue;
+        }
+
+        /* Shared mappings are never evicted; the entry stays put */
+        coremap_lock_acquire();
+        entry = *pte;
+        if (entry & TLBLO_DIRTY) {
+            *pte = entry & ~TLBLO_DIRTY;
+            vm_tlbinvalidate(as, vaddr);
+        }
+        coremap_lock_release();
+
+        if (entry & TLBLO_DIRTY) {
+            /* Any store after this faults and sets the bit again */
+            ipi_tlbshootdown_wait();
+        }
+
+        offset = rg->rg_fileoffset + (vaddr - rg->rg_vbase);
+        if ((entry & TLBLO_DIRTY) && offset < st.st_size) {
+            len = PAGE_SIZE;
+            if ((off_t)len > st.st_size - offset) {
+                len = st.st_size - offset;
+            }
+            uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(PTE_PADDR(entry)),
+                      len, offset, UIO_WRITE);
+            result = VOP_WRITE(rg->rg_vnode, &u);
+            if (result) {
+                /* Still needs writing */
+                coremap_lock_acquire();
+                *pte |= TLBLO_DIRTY;
+                coremap_lock_release();
+                return result;
+            }
+        }
+
+        vaddr += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Fault-around. When a region is walked through page by page, load
+ * the entries for the next few resident pages along with the one
+ * faulted on, so the walk takes one exception per window rather than
+ * one per page.
+ *
+ * The window starts at one page once two faults in a row are on
+ * neighbouring pages, doubles (up to FAULTAROUND_MAX) every time the
+ * walk next faults just past the end of it, and is dropped on any
+ * other fault in the region. Nothing is brought in: pages that are
+ * not resident end the window. Pages the clock is checking (VALID
+ * clear) are skipped, and the reference bits are left alone, so that
+ * only a real access gives a page its second chance.
+ *
+ * Called with coremap_lock held and interrupts off, before the
+ * faulting entry goes in, so it can't push that one out.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *rg, vaddr_t faultaddress)
+{
+    vaddr_t va, top;
+    pte_t *pte;
+    uint32_t ehi;
+    unsigned i, n;
+
+    if (faultaddress == rg->rg_fanext && rg->rg_fawindow > 0) {
+        n = rg->rg_fawindow * 2;
+    }
+    else if (faultaddress == rg->rg_falast + PAGE_SIZE) {
+        rg->rg_fadir = 1;
+        n = 1;
+    }
+    else if (faultaddress + PAGE_SIZE == rg->rg_falast) {
+        rg->rg_fadir = -1;
+        n = 1;
+    }
+    else {
+        n = 0;
+    }
+    if (n > FAULTAROUND_MAX) {
+        n = FAULTAROUND_MAX;
+    }
+
+    top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+    va = faultaddress;
+    for (i = 0; i < n; i++) {
+        va = rg->rg_fadir > 0 ? va + PAGE_SIZE : va - PAGE_SIZE;
+        if (va < rg->rg_vbase || va >= top) {
+            break;
+        }
+        pte = pt_lookup(as, va, 0);
+        if (pte == NULL || (*pte & PTE_BUSY) || !PTE_RESIDENT(*pte)) {
+            break;
+        }
+        if (!(*pte & TLBLO_VALID)) {
+            continue;
+        }
+
+        ehi = va | (curcpu->c_asid << TLBHI_PIDSHIFT);
+        if (tlb_probe(ehi, 0) < 0) {
+            tlb_prefill(ehi, *pte & ~PTE_SWBITS);
+        }
+    }
+
+    rg->rg_falast = faultaddress;
+    rg->rg_fawindow = i;
+    if (i == n) {
+        va = rg->rg_fadir > 0 ? va + PAGE_SIZE : va - PAGE_SIZE;
+    }
+    rg->rg_fanext = va;
+}
+
+#endif
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+    #if OPT_A3
+    struct region *rg;
+    pte_t *pte, entry;
+    struct coremap_entry *cme;
+    bool loaded;
+    int result;
+    #else
     vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+    #endif
     paddr_t paddr;
     int i;
     uint32_t ehi, elo;
     struct addrspace *as;
-    int spl, segment;
+    int spl;
 
     faultaddress &= PAGE_FRAME;
 
@@ -306,13 +1985,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
     switch (faulttype) {
         case VM_FAULT_READONLY:
-            /* We always create pages read-write, so we can't get this */
             #if OPT_A3
 
-            sys__exit(EX_MOD);
+            /* Copy-on-write pages are read-only; sorted out below */
+            break;
 
             #else
 
+            /* We always create pages read-write, so we can't get this */
             panic("dumbvm: got VM_FAULT_READONLY\n");
 
             #endif
@@ -324,6 +2004,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             return EINVAL;
     }
 
+    #if OPT_A3
+    if (faultaddress >= MIPS_KSEG2) {
+        /* A large kernel allocation; only the kernel gets here */
+        return kva_fault(faultaddress);
+    }
+    #endif
+
     if (curproc == NULL) {
         /*
          * No process. This is probably a kernel fault early
@@ -333,25 +2020,185 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    as = curproc_getas();
-    if (as == NULL) {
-        /*
-         * No address space set up. This is probably also a
-         * kernel fault early in boot.
-         */
-        return EFAULT;
+    as = curproc_getas();
+    if (as == NULL) {
+        /*
+         * No address space set up. This is probably also a
+         * kernel fault early in boot.
+         */
+        return EFAULT;
+    }
+
+    #if OPT_A3
+
+    /* Assert that the address space has been set up properly. */
+    KASSERT(as->as_pagedir != NULL);
+
+    rg = as_find_region(as, faultaddress);
+    if (rg == NULL) {
+        /* Just below the stack is more stack, up to a point */
+        rg = as_growstack(as, faultaddress);
+        if (rg == NULL) {
+            return EFAULT;
+        }
+    }
+
+    /* Writing to a read-only region, i.e. the text */
+    if (faulttype != VM_FAULT_READ && !rg->rg_writeable) {
+        sys__exit(EX_MOD);
+    }
+
+    pte = pt_lookup(as, faultaddress, 1);
+    if (pte == NULL) {
+        return ENOMEM;
+    }
+
+    /*
+     * Get the page into memory and sort out copy-on-write. Every
+     * step that can sleep drops coremap_lock, after which the page
+     * may have been evicted again, so go round until it all holds
+     * with the lock held. The lock is kept until the TLB entry is
+     * in, so the page cannot be evicted under our feet.
+     */
+    loaded = false;
+    coremap_lock_acquire();
+    for (;;) {
+        entry = *pte;
+        if (entry & PTE_BUSY) {
+            /* On its way out to swap */
+            coremap_lock_release();
+            pagetable_wait(pte);
+        }
+        else if (!PTE_RESIDENT(entry)) {
+            /* First touch, or evicted */
+            coremap_lock_release();
+            if (entry & PTE_SWAPPED) {
+                result = as_swapin_page(as, rg, faultaddress, pte);
+            }
+            else if (rg->rg_vnode != NULL) {
+                result = as_load_mapped(rg, faultaddress, pte);
+            }
+            else {
+                result = as_load_page(as, rg, faultaddress, pte,
+                                      faulttype);
+            }
+            if (result) {
+                return result;
+            }
+            loaded = true;
+        }
+        else {
+            if (!(entry & TLBLO_VALID)) {
+                /* The clock is checking whether we still use it */
+                entry |= TLBLO_VALID;
+                *pte = entry;
+            }
+            cme = &coremap[(PTE_PADDR(entry) - firstaddr) / PAGE_SIZE];
+            if (cme->refcount == 1 && !rg->rg_shared &&
+                (cme->as == NULL || (entry & PTE_COW))) {
+                /* Nobody shares the frame any more; it is ours again */
+                entry &= ~PTE_COW;
+                if (rg->rg_writeable) {
+                    entry |= TLBLO_DIRTY;
+                }
+                *pte = entry;
+                cme->as = as;
+                cme->vpn = faultaddress / PAGE_SIZE;
+            }
+
+            /* First write to a shared mapping's page since it was synced */
+            if (faulttype != VM_FAULT_READ && rg->rg_shared &&
+                !(entry & TLBLO_DIRTY)) {
+                entry |= TLBLO_DIRTY;
+                *pte = entry;
+            }
+
+            /* First write since it came in from swap: the copy there is stale */
+            if (faulttype != VM_FAULT_READ && (entry & PTE_SWAPCOPY)) {
+                swap_free(cme->next);
+                entry = (entry & ~PTE_SWAPCOPY) | TLBLO_DIRTY;
+                *pte = entry;
+            }
+
+            /*
+             * Writing to a copy-on-write page: take a private copy
+             * now. A write miss does this straight away rather than
+             * loading a read-only entry only to take a TLB modify
+             * fault right after.
+             */
+            if (faulttype == VM_FAULT_READ || !(entry & PTE_COW)) {
+                break;
+            }
+            coremap_lock_release();
+            result = pagetable_unshare(as, faultaddress, pte);
+            if (result) {
+                return result;
+            }
+        }
+        coremap_lock_acquire();
+    }
+
+    /* Give the page its second chance the next time the clock comes by */
+    cme->referenced = 1;
+    paddr = PTE_PADDR(entry);
+
+    /* make sure it's page-aligned */
+    KASSERT((paddr & PAGE_FRAME) == paddr);
+    KASSERT(entry & TLBLO_VALID);
+
+    /* Disable interrupts on this CPU while frobbing the TLB. */
+    spl = splhigh();
+
+    /* The page table entry is the TLB entry, bar the software bits */
+    ehi = faultaddress | (curcpu->c_asid << TLBHI_PIDSHIFT);
+    elo = entry & ~PTE_SWBITS;
+
+    /*
+     * Reuse the entry if the page is already in the TLB (read-only,
+     * before it was unshared), else leave it to the replacement
+     * policy.
+     */
+    DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+    vm_faultaround(as, rg, faultaddress);
+    i = tlb_probe(ehi, 0);
+    if (i >= 0) {
+        /* Nothing else gets pushed out */
+        tlb_write(ehi, elo, i);
+        vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+    }
+    else {
+        tlb_replace(ehi, elo);
+    }
+
+    /*
+     * Refills done by the UTLB handler never get here, so these are
+     * the faults that needed C: first touches, evicted pages, the
+     * clock's reference checks and copy-on-write.
+     */
+    vmstats_inc(VMSTAT_TLB_FAULT);
+    if (!loaded) {
+        vmstats_inc(VMSTAT_TLB_RELOAD);
     }
 
+    splx(spl);
+    coremap_lock_release();
+    return 0;
+
+    #else
+
     /* Assert that the address space has been set up properly. */
     KASSERT(as->as_vbase1 != 0);
-    KASSERT(as->page_pbase1 != 0);
+    KASSERT(as->as_pbase1 != 0);
     KASSERT(as->as_npages1 != 0);
-    KASSERT(as->page_pbase2 != 0);
     KASSERT(as->as_vbase2 != 0);
+    KASSERT(as->as_pbase2 != 0);
     KASSERT(as->as_npages2 != 0);
-    KASSERT(as->page_stackpbase != 0);
+    KASSERT(as->as_stackpbase != 0);
     KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+    KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
     KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+    KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+    KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
     vbase1 = as->as_vbase1;
     vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -361,28 +2208,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     stacktop = USERSTACK;
 
     if (faultaddress >= vbase1 && faultaddress < vtop1) {
-        #if OPT_A3
-        paddr = as->page_pbase1[(faultaddress - vbase1)/ PAGE_SIZE].paddr;
-        #else
         paddr = (faultaddress - vbase1) + as->as_pbase1;
-        #endif 
-        segment = TEXT_SEGMENT;
     }
     else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-        #if OPT_A3
-        paddr = as->page_pbase2[(faultaddress - vbase2) / PAGE_SIZE].paddr;
-        #else
         paddr = (faultaddress - vbase2) + as->as_pbase2;
-        #endif
-        segment = DATA_SEGMENT;
     }
     else if (faultaddress >= stackbase && faultaddress < stacktop) {
-        #if OPT_A3
-        paddr = as->page_stackpbase[((faultaddress - stackbase)) / PAGE_SIZE].paddr;
-        #else
         paddr = (faultaddress - stackbase) + as->as_stackpbase;
-        #endif
-        segment = STACK_SEGMENT;
     }
     else {
         return EFAULT;
@@ -401,36 +2233,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         }
         ehi = faultaddress;
         elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-
-        #ifdef OPT_A3
-        // If it's the text 
-        if(segment == TEXT_SEGMENT && curproc->loaded == true) {
-              elo &= ~TLBLO_DIRTY;
-        }
-        #endif
-
         DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
         tlb_write(ehi, elo, i);
         splx(spl);
         return 0;
     }
 
-    #if OPT_A3
-    
-    // Set the values for ehi and elo
-    ehi = faultaddress;
-    elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-    // If it's the text 
-    if(segment == TEXT_SEGMENT && curproc->loaded == true) {
-          elo &= ~TLBLO_DIRTY;
-    }
-    // Pass to random !
-    tlb_random(ehi, elo);
-    splx(spl);
-    return 0;
-
-    #else
-
     kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
     splx(spl);
     return EFAULT;
@@ -446,13 +2254,33 @@ as_create(void)
         return NULL;
     }
 
+    #if OPT_A3
+    as->as_regions = NULL;
+    as->as_file = NULL;
+    as->as_heap = NULL;
+    as->as_heapend = 0;
+    as->as_stack = NULL;
+    as->as_asid = 0;
+    as->as_asidgen = 0;
+    as->as_forknext = as;
+    as->as_forkprev = as;
+
+    /* Second-level tables are only allocated once something is touched */
+    as->as_pagedir = kmalloc(PT_L1_SIZE * sizeof(pte_t *));
+    if (as->as_pagedir == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    bzero(as->as_pagedir, PT_L1_SIZE * sizeof(pte_t *));
+    #else
     as->as_vbase1 = 0;
-    as->page_pbase1 = 0;
+    as->as_pbase1 = 0;
     as->as_npages1 = 0;
     as->as_vbase2 = 0;
-    as->page_pbase2 = 0;
+    as->as_pbase2 = 0;
     as->as_npages2 = 0;
-    as->page_stackpbase = 0;
+    as->as_stackpbase = 0;
+    #endif
 
     return as;
 }
@@ -461,29 +2289,32 @@ void
 as_destroy(struct addrspace *as)
 {
     #ifdef OPT_A3
-    /* Time to destroy the text page table */
-    size_t npages1 = as->as_npages1;
-    struct pagetable_entry* text = as->page_pbase1;
-    for (size_t i = 0; i < npages1; i++) {
-        free_kpages(PADDR_TO_KVADDR(text[i].paddr));
-    }
+    struct region *rg;
 
-    /* Time to destroy the data page table */
-    size_t npages2 = as->as_npages2;
-    struct pagetable_entry* data = as->page_pbase2;
-    for (size_t i = 0; i < npages2; i++) {
-        free_kpages(PADDR_TO_KVADDR(data[i].paddr));
+    /* What was written to shared mappings goes to the file */
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (rg->rg_vnode != NULL && rg->rg_shared) {
+            as_syncregion(as, rg, rg->rg_vbase,
+                          rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+        }
     }
 
-    /* Time to destroy the stack page table */
-    struct pagetable_entry* stack = as->page_stackpbase;
-    for (size_t i = 0; i < DUMBVM_STACKPAGES; i++) {
-        free_kpages(PADDR_TO_KVADDR(stack[i].paddr));
+    /* Pages that were never touched have no frame to give back */
+    pagetable_free(as);
+
+    while (as->as_regions != NULL) {
+        rg = as->as_regions;
+        as->as_regions = rg->rg_next;
+        if (rg->rg_vnode != NULL) {
+            VOP_DECREF(rg->rg_vnode);
+        }
+        kfree(rg);
     }
 
-    free_kpages((vaddr_t)as->page_pbase1);
-    free_kpages((vaddr_t)as->page_pbase2);
-    free_kpages((vaddr_t)as->page_stackpbase);
+    /* Drop our reference to the executable */
+    if(as->as_file != NULL) {
+        VOP_DECREF(as->as_file);
+    }
     #endif
     kfree(as);
 }
@@ -493,36 +2324,94 @@ as_activate(void)
 {
     int i, spl;
     struct addrspace *as;
+    #if OPT_A3
+    bool flush;
+    #endif
 
     as = curproc_getas();
 #ifdef UW
         /* Kernel threads don't have an address spaces to activate */
 #endif
     if (as == NULL) {
+        #if OPT_A3
+        cpupagedirs[curcpu->c_number] = 0;
+        #endif
         return;
     }
 
     /* Disable interrupts on this CPU while frobbing the TLB. */
     spl = splhigh();
 
+    #if OPT_A3
+
+    /*
+     * Entries of other address spaces can stay in the TLB, as long
+     * as ours carry an ID of their own. Get one if the one we have
+     * is from an older generation (or we never had one).
+     */
+    spinlock_acquire(&asid_lock);
+    if (as->as_asidgen != asid_gen) {
+        if (asid_next == NUM_TLBPID) {
+            /* Out of IDs; everybody gets a new one from now on */
+            asid_gen++;
+            asid_next = 1;
+        }
+        as->as_asid = asid_next++;
+        as->as_asidgen = asid_gen;
+    }
+    flush = curcpu->c_asidgen != as->as_asidgen;
+    curcpu->c_asidgen = as->as_asidgen;
+    curcpu->c_asid = as->as_asid;
+    spinlock_release(&asid_lock);
+
+    /* Our TLB may still hold entries tagged with recycled IDs */
+    if (flush) {
+        for (i=0; i<NUM_TLB; i++) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+        tlb_flushed();
+        vmstats_inc(VMSTAT_TLB_INVALIDATE);
+    }
+
+    tlb_setasid(curcpu->c_asid);
+
+    /* Let the UTLB handler refill straight from our page table */
+    cpupagedirs[curcpu->c_number] = (vaddr_t)as->as_pagedir;
+
+    #else
+
     for (i=0; i<NUM_TLB; i++) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
 
+    #endif
+
     splx(spl);
 }
 
 void
 as_deactivate(void)
 {
+    #if OPT_A3
+    int spl;
+
+    /* The address space may be about to go away; stop refilling from it */
+    spl = splhigh();
+    cpupagedirs[curcpu->c_number] = 0;
+    splx(spl);
+    #else
     /* nothing */
+    #endif
 }
 
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
          int readable, int writeable, int executable)
 {
-    size_t npages; 
+    size_t npages;
+    #if OPT_A3
+    struct region *rg;
+    #endif
 
     /* Align the region. First, the base... */
     sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -533,6 +2422,50 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
     npages = sz / PAGE_SIZE;
 
+    #if OPT_A3
+    /* Only the write permission matters; the MIPS can't do the others */
+    (void)readable;
+    (void)executable;
+
+    /*
+     * Pages are no longer loaded through uiomove, which used to
+     * catch segments placed in kernel space. Check for it here.
+     */
+    if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+        return EFAULT;
+    }
+
+    /* Regions may not overlap */
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+            rg->rg_vbase < vaddr + sz) {
+            return EINVAL;
+        }
+    }
+
+    rg = kmalloc(sizeof(struct region));
+    if (rg == NULL) {
+        return ENOMEM;
+    }
+    rg->rg_vbase = vaddr;
+    rg->rg_npages = npages;
+    rg->rg_writeable = writeable != 0;
+    rg->rg_filevaddr = vaddr;
+    rg->rg_fileoffset = 0;
+    rg->rg_filesize = 0;
+    rg->rg_vnode = NULL;
+    rg->rg_shared = 0;
+    rg->rg_falast = 0;
+    rg->rg_fanext = 0;
+    rg->rg_fadir = 1;
+    rg->rg_fawindow = 0;
+
+    rg->rg_next = as->as_regions;
+    as->as_regions = rg;
+    return 0;
+
+    #else
+
     /* We don't use these - all pages are read-write */
     (void)readable;
     (void)writeable;
@@ -555,83 +2488,20 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
      */
     kprintf("dumbvm: Warning: too many regions\n");
     return EUNIMP;
-}
-
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-    bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+    #endif
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
     #if OPT_A3
-    KASSERT(as->page_pbase1 == NULL);
-    KASSERT(as->page_pbase2 == NULL);
-    KASSERT(as->page_stackpbase == NULL);
-
-    /* Now we initialize text page table */
-    as->page_pbase1 = pagetable_alloc(as->as_npages1);
-    if(as->page_pbase1 == 0) {
-        return ENOMEM;
-    }
-
-    /* Now we initialize data page table */
-    as->page_pbase2 = pagetable_alloc(as->as_npages2);
-    if(as->page_pbase2 == 0) {
-        return ENOMEM;
-    }
-
-    /* Now we initialize stack page table */
-    as->page_stackpbase = pagetable_alloc(DUMBVM_STACKPAGES);
-    if(as->page_stackpbase == 0) {
-        return ENOMEM;
-    }
-
-    /* Now we map frames for text page table */
-    struct pagetable_entry* text = as->page_pbase1;
-    for(size_t i = 0; i < as->as_npages1; i++) {
-       /* We allocate one page */
-       text[i].paddr = getppages(1);
-       /* Check if getppages succedd */
-       if(text[i].paddr == 0) {
-             return ENOMEM;
-       }
-       /* Zero out the allocated page */
-       as_zero_region(text[i].paddr, 1);
-    }
-
-    /* Now we map frames for data page table */
-    struct pagetable_entry* data = as->page_pbase2;
-    for (size_t i = 0; i < as->as_npages2; i++) {
-       /* We allocate one page */
-       data[i].paddr = getppages(1);
-       /* Check if getppages succedd */
-       if(data[i].paddr == 0) {
-             return ENOMEM;
-       }
-       /* Zero out the allocated page */
-       as_zero_region(data[i].paddr, 1);
-    }
-
-    /* Now we map frames for stack page table */
-    struct pagetable_entry* stack = as->page_stackpbase;
-    for (size_t i = 0; i < DUMBVM_STACKPAGES; i++) {
-       /* We allocate one page */
-       stack[i].paddr = getppages(1);
-       /* Check if getppages succedd */
-       if(stack[i].paddr == 0) {
-             return ENOMEM;
-       }
-       /* Zero out the allocated page */
-       as_zero_region(stack[i].paddr, 1);
-    }
-
+    /*
+     * Nothing to do. Page tables and frames are allocated by
+     * vm_fault for each page the first time it gets touched.
+     */
+    (void)as;
     return 0;
 
-
     #else
     KASSERT(as->as_pbase1 == 0);
     KASSERT(as->as_pbase2 == 0);
@@ -651,7 +2521,7 @@ as_prepare_load(struct addrspace *as)
     if (as->as_stackpbase == 0) {
         return ENOMEM;
     }
-    
+
     as_zero_region(as->as_pbase1, as->as_npages1);
     as_zero_region(as->as_pbase2, as->as_npages2);
     as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
@@ -663,23 +2533,262 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-    
-    (void)as;
+    #if OPT_A3
+    struct region *rg;
+    vaddr_t top;
+    int result;
+
+    /* The heap starts out empty, on the page after the highest segment */
+    top = 0;
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top) {
+            top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+        }
+    }
 
-    #ifdef OPT_A3
-    
-    curproc->loaded = true;
-    as_activate();
+    result = as_define_region(as, top, 0, 1, 1, 0);
+    if (result) {
+        return result;
+    }
+
+    /* as_define_region put it at the front */
+    as->as_heap = as->as_regions;
+    as->as_heapend = top;
+    return 0;
+
+    #else
+    (void)as;
 
+    return 0;
     #endif
+}
+
+#if OPT_A3
+
+int
+as_define_backing(struct addrspace *as, struct vnode *v, off_t offset,
+                  vaddr_t vaddr, size_t filesize)
+{
+    struct region *rg;
+
+    /* The file-backed part has to lie inside a region we defined */
+    rg = as_find_region(as, vaddr);
+    if (rg == NULL ||
+        filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+        return ENOEXEC;
+    }
+
+    rg->rg_filevaddr = vaddr;
+    rg->rg_fileoffset = offset;
+    rg->rg_filesize = filesize;
+
+    /* Hold on to the executable until the address space goes away */
+    if (as->as_file == NULL) {
+        VOP_INCREF(v);
+        as->as_file = v;
+    }
+    KASSERT(as->as_file == v);
+
+    return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+        int writeable, int shared, vaddr_t hint, vaddr_t *ret)
+{
+    struct region *rg;
+    vaddr_t vaddr, top;
+    size_t sz;
+    int result;
+
+    if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+        return EINVAL;
+    }
+    if (len > MMAP_TOP) {
+        return ENOMEM;
+    }
+    sz = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+    /*
+     * Take the hint if there is room there. Otherwise go down from
+     * MMAP_TOP, hopping below every region in the way; page 0 stays
+     * unmapped.
+     */
+    vaddr = hint & PAGE_FRAME;
+    if (vaddr == 0 || vaddr >= MMAP_TOP || sz > MMAP_TOP - vaddr ||
+        !as_range_free(as, vaddr, sz)) {
+        top = MMAP_TOP;
+        for (;;) {
+            if (top < sz + PAGE_SIZE) {
+                return ENOMEM;
+            }
+            vaddr = top - sz;
+            for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+                    rg->rg_vbase < top) {
+                    break;
+                }
+            }
+            if (rg == NULL) {
+                break;
+            }
+            top = rg->rg_vbase;
+        }
+    }
+
+    result = as_define_region(as, vaddr, sz, 1, writeable, 0);
+    if (result) {
+        return result;
+    }
+
+    /* as_define_region put it at the front */
+    rg = as->as_regions;
+    rg->rg_filevaddr = vaddr;
+    rg->rg_fileoffset = offset;
+    rg->rg_filesize = len;
+    rg->rg_vnode = v;
+    rg->rg_shared = shared != 0;
+    VOP_INCREF(v);
+
+    *ret = vaddr;
+    return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *rg, **rgp;
+    vaddr_t top;
+    int result;
+
+    /* Only whole mappings can go */
+    for (rgp = &as->as_regions; *rgp != NULL; rgp = &(*rgp)->rg_next) {
+        if ((*rgp)->rg_vbase == vaddr) {
+            break;
+        }
+    }
+    rg = *rgp;
+    if (rg == NULL || rg->rg_vnode == NULL ||
+        (len + PAGE_SIZE - 1) / PAGE_SIZE != rg->rg_npages) {
+        return EINVAL;
+    }
+    top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+
+    if (rg->rg_shared) {
+        result = as_syncregion(as, rg, rg->rg_vbase, top);
+        if (result) {
+            return result;
+        }
+    }
+
+    pagetable_unmap(as, rg->rg_vbase, top);
+    as_tlbflush(as);
+
+    *rgp = rg->rg_next;
+    VOP_DECREF(rg->rg_vnode);
+    kfree(rg);
+    return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *rg;
+    vaddr_t start, end, top;
+    int result;
+
+    if (vaddr % PAGE_SIZE != 0 || len > USERSPACETOP - vaddr) {
+        return EINVAL;
+    }
+
+    for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+        if (rg->rg_vnode == NULL || !rg->rg_shared) {
+            continue;
+        }
+        top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+        start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+        end = vaddr + len < top ? vaddr + len : top;
+        if (start < end) {
+            result = as_syncregion(as, rg, start, end);
+            if (result) {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t change, vaddr_t *ret)
+{
+    struct region *rg;
+    vaddr_t oldbreak, newbreak, oldtop, newtop;
+
+    rg = as->as_heap;
+    if (rg == NULL) {
+        return ENOMEM;
+    }
+
+    oldbreak = as->as_heapend;
+    if (change < 0) {
+        /*
+         * Negate in unsigned: -change overflows for the most negative
+         * change, which this way comes out far too big, so EINVAL.
+         */
+        if (-(vaddr_t)change > oldbreak - rg->rg_vbase) {
+            return EINVAL;
+        }
+    }
+    else if ((vaddr_t)change > HEAP_MAX - (oldbreak - rg->rg_vbase)) {
+        return ENOMEM;
+    }
+    newbreak = oldbreak + change;
+
+    oldtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+    newtop = (newbreak + PAGE_SIZE - 1) & PAGE_FRAME;
+
+    if (newtop > oldtop) {
+        /* Growing; the pages are filled in by vm_fault as they get used */
+        if (!as_range_free(as, oldtop, newtop - oldtop)) {
+            return ENOMEM;
+        }
+        rg->rg_npages = (newtop - rg->rg_vbase) / PAGE_SIZE;
+    }
+    else if (newtop < oldtop) {
+        /*
+         * Shrinking; what was above the new break is gone. The
+         * pages go first, as page_evict expects every page it finds
+         * to be inside a region.
+         */
+        pagetable_unmap(as, newtop, oldtop);
+        as_tlbflush(as);
+        rg->rg_npages = (newtop - rg->rg_vbase) / PAGE_SIZE;
+    }
 
+    as->as_heapend = newbreak;
+    *ret = oldbreak;
     return 0;
 }
 
+#endif
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-    KASSERT(as->page_stackpbase != 0);
+    #if OPT_A3
+    int result;
+
+    result = as_define_region(as, USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE,
+                              DUMBVM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+    if (result) {
+        return result;
+    }
+
+    /* as_define_region put it at the front; vm_fault grows it */
+    as->as_stack = as->as_regions;
+    #else
+    KASSERT(as->as_stackpbase != 0);
+    #endif
 
     *stackptr = USERSTACK;
     return 0;
@@ -689,12 +2798,79 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
     struct addrspace *new;
+    #if OPT_A3
+    struct region *oldrg, *rg;
+    int result;
+    #endif
 
     new = as_create();
     if (new==NULL) {
         return ENOMEM;
     }
 
+    #if OPT_A3
+
+    /* Pages the parent never touched are still loaded from the file */
+    new->as_file = old->as_file;
+    if (new->as_file != NULL) {
+        VOP_INCREF(new->as_file);
+    }
+
+    for (oldrg = old->as_regions; oldrg != NULL; oldrg = oldrg->rg_next) {
+        rg = kmalloc(sizeof(struct region));
+        if (rg == NULL) {
+            as_destroy(new);
+            return ENOMEM;
+        }
+        *rg = *oldrg;
+        if (rg->rg_vnode != NULL) {
+            VOP_INCREF(rg->rg_vnode);
+        }
+        if (oldrg == old->as_heap) {
+            new->as_heap = rg;
+        }
+        if (oldrg == old->as_stack) {
+            new->as_stack = rg;
+        }
+        rg->rg_next = new->as_regions;
+        new->as_regions = rg;
+    }
+    new->as_heapend = old->as_heapend;
+
+    /* The child may end up the only owner of some of the parent's frames */
+    coremap_lock_acquire();
+    new->as_forknext = old->as_forknext;
+    new->as_forkprev = old;
+    old->as_forknext->as_forkprev = new;
+    old->as_forknext = new;
+    coremap_lock_release();
+
+    /*
+     * Share the frames instead of copying them. Read-only regions
+     * (the text) are never written, so they can simply be shared;
+     * writeable ones become copy-on-write in both parent and child,
+     * except for shared mappings, which are shared for real.
+     */
+    result = 0;
+    for (oldrg = old->as_regions; oldrg != NULL && result == 0;
+         oldrg = oldrg->rg_next) {
+        result = pagetable_share(old, new, oldrg);
+    }
+
+    /*
+     * The parent may still have writeable TLB entries for the
+     * pages that just became copy-on-write, here or on any cpu it
+     * ran on before.
+     */
+    as_tlbflush(old);
+
+    if (result) {
+        as_destroy(new);
+        return result;
+    }
+
+    #else
+
     new->as_vbase1 = old->as_vbase1;
     new->as_npages1 = old->as_npages1;
     new->as_vbase2 = old->as_vbase2;
@@ -706,43 +2882,6 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         return ENOMEM;
     }
 
-    #if OPT_A3
-
-    KASSERT(new->page_pbase1 != 0);
-    KASSERT(new->page_pbase2 != 0);
-    KASSERT(new->page_stackpbase != 0);
-
-    /* Text segment */ 
-    size_t npages1 = new->as_npages1;
-    struct pagetable_entry* new_text = new->page_pbase1;
-    struct pagetable_entry* old_text = old->page_pbase1;
-    for(size_t i = 0; i < npages1; i++) {
-        memmove((void *)PADDR_TO_KVADDR(new_text[i].paddr),
-        (const void *)PADDR_TO_KVADDR(old_text[i].paddr),
-        PAGE_SIZE);
-    }
-
-
-    /* Data segment */ 
-    size_t npages2 = new->as_npages2;
-    struct pagetable_entry* new_data = new->page_pbase2;
-    struct pagetable_entry* old_data = old->page_pbase2;
-    for(size_t i = 0; i < npages2; i++) {
-        memmove((void *)PADDR_TO_KVADDR(new_data[i].paddr),
-        (const void *)PADDR_TO_KVADDR(old_data[i].paddr),
-        PAGE_SIZE);
-    }    
-
-    /* Stack segment */ 
-    struct pagetable_entry* new_stack = new->page_stackpbase;
-    struct pagetable_entry* old_stack = old->page_stackpbase;
-    for(size_t i = 0; i < DUMBVM_STACKPAGES; i++) {
-        memmove((void *)PADDR_TO_KVADDR(new_stack[i].paddr),
-        (const void *)PADDR_TO_KVADDR(old_stack[i].paddr),
-        PAGE_SIZE);
-    }
-    #else
-
     KASSERT(new->as_pbase1 != 0);
     KASSERT(new->as_pbase2 != 0);
     KASSERT(new->as_stackpbase != 0);
@@ -758,7 +2897,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
         (const void *)PADDR_TO_KVADDR(old->as_stackpbase),
         DUMBVM_STACKPAGES*PAGE_SIZE);
-    
+
     #endif
 
     *ret = new;
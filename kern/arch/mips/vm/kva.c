@@ -0,0 +1,230 @@
+/* Multi-page kernel allocations mapped through KSEG2. See mips/vm.h */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <mips/tlb.h>
+
+/* The window runs from KVA_BASE up for KVA_PAGES pages (16M) */
+#define KVA_BASE   MIPS_KSEG2
+#define KVA_PAGES  4096
+
+/* kva_map value of the pages of a run after its first */
+#define KVA_CONT   0xffff
+
+/*
+ * Kernel page table for the window: the EntryLo of each page, or 0.
+ * An entry is filled in before its address is handed out and only
+ * cleared once it has been given back, so kva_fault reads it without
+ * a lock. While a page is being freed its entry keeps the frame but
+ * loses TLBLO_VALID, so that it can no longer be faulted in.
+ */
+static uint32_t kva_ptes[KVA_PAGES];
+
+/*
+ * Which pages are taken. The first page of an allocation holds its
+ * length in pages, the others KVA_CONT, and free pages 0. This and
+ * the cursor are protected by kva_lock.
+ */
+static uint16_t kva_map[KVA_PAGES];
+static unsigned kva_cursor;
+static struct spinlock kva_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Find NPAGES free pages in a row and mark them taken. Returns the
+ * index of the first, or -1.
+ *
+ * Next fit: the search starts where the last one left off, so that a
+ * range just given back is the last to be handed out again. (The
+ * other cpus have dropped their TLB entries for it by then anyway;
+ * kva_release waits for that before it frees the frames.)
+ */
+static
+int
+kva_reserve(unsigned npages)
+{
+    unsigned i, n, start, run;
+
+    spinlock_acquire(&kva_lock);
+
+    i = kva_cursor;
+    start = 0;
+    run = 0;
+    for (n = 0; n < KVA_PAGES + npages && run < npages; n++, i++) {
+        if (i == KVA_PAGES) {
+            /* Runs don't wrap around */
+            i = 0;
+            run = 0;
+        }
+        if (kva_map[i] != 0) {
+            run = 0;
+        }
+        else if (run++ == 0) {
+            start = i;
+        }
+    }
+    if (run < npages) {
+        spinlock_release(&kva_lock);
+        return -1;
+    }
+
+    kva_map[start] = npages;
+    for (i = 1; i < npages; i++) {
+        kva_map[start + i] = KVA_CONT;
+    }
+    kva_cursor = (start + npages) % KVA_PAGES;
+
+    spinlock_release(&kva_lock);
+    return start;
+}
+
+/* Drop the TLB entry for VADDR, here and on the other cpus */
+static
+void
+kva_invalidate(vaddr_t vaddr)
+{
+    struct tlbshootdown ts;
+    int i, spl;
+
+    /* Global entries match whatever the address space ID */
+    spl = splhigh();
+    i = tlb_probe(vaddr, 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    splx(spl);
+
+    ts.ts_addrspace = NULL;
+    ts.ts_vaddr = vaddr;
+    ts.ts_asid = 0;
+    ts.ts_asidgen = 0;
+    ipi_tlbshootdown_broadcast(&ts);
+}
+
+/* Free the frames behind the first NMAPPED pages at index START */
+static
+void
+kva_freeframes(unsigned start, unsigned nmapped)
+{
+    unsigned i;
+    uint32_t elo;
+
+    for (i = 0; i < nmapped; i++) {
+        elo = kva_ptes[start + i];
+        kva_ptes[start + i] = 0;
+        free_kpages(PADDR_TO_KVADDR(elo & TLBLO_PPAGE));
+    }
+}
+
+/* Give the range of the allocation at index START back */
+static
+void
+kva_unreserve(unsigned start)
+{
+    unsigned i, npages;
+
+    spinlock_acquire(&kva_lock);
+    npages = kva_map[start];
+    KASSERT(npages != 0 && npages != KVA_CONT);
+    for (i = 0; i < npages; i++) {
+        kva_map[start + i] = 0;
+    }
+    spinlock_release(&kva_lock);
+}
+
+/*
+ * Unmap and free the allocation at index START, which is NPAGES long.
+ * The frames are only freed once every cpu has dropped its TLB entries
+ * for them; a global entry left behind would let it write to the
+ * frame's next owner.
+ */
+static
+void
+kva_release(unsigned start, unsigned npages)
+{
+    unsigned i;
+
+    for (i = 0; i < npages; i++) {
+        kva_ptes[start + i] &= ~TLBLO_VALID;
+        kva_invalidate(KVA_BASE + (start + i) * PAGE_SIZE);
+    }
+    ipi_tlbshootdown_wait();
+
+    kva_freeframes(start, npages);
+    kva_unreserve(start);
+}
+
+vaddr_t
+kva_alloc(unsigned npages)
+{
+    vaddr_t page;
+    unsigned i;
+    int start;
+
+    if (npages == 0 || npages >= KVA_CONT) {
+        return 0;
+    }
+
+    start = kva_reserve(npages);
+    if (start < 0) {
+        return 0;
+    }
+
+    /* Single pages come straight from KSEG0, never from here */
+    for (i = 0; i < npages; i++) {
+        page = alloc_kpages(1);
+        if (page == 0) {
+            /*
+             * Never handed out, so no cpu has an entry for it: no
+             * shootdown, and no waiting, which the caller may not do.
+             */
+            kva_freeframes(start, i);
+            kva_unreserve(start);
+            return 0;
+        }
+        kva_ptes[start + i] = KVADDR_TO_PADDR(page) |
+            TLBLO_GLOBAL | TLBLO_DIRTY | TLBLO_VALID;
+    }
+
+    return KVA_BASE + start * PAGE_SIZE;
+}
+
+void
+kva_free(vaddr_t vaddr)
+{
+    unsigned start;
+
+    KASSERT(vaddr % PAGE_SIZE == 0);
+    KASSERT(vaddr >= KVA_BASE &&
+            vaddr - KVA_BASE < KVA_PAGES * PAGE_SIZE);
+
+    start = (vaddr - KVA_BASE) / PAGE_SIZE;
+    KASSERT(kva_map[start] != 0 && kva_map[start] != KVA_CONT);
+
+    kva_release(start, kva_map[start]);
+}
+
+int
+kva_fault(vaddr_t vaddr)
+{
+    uint32_t elo;
+    int spl;
+
+    if (vaddr - KVA_BASE >= KVA_PAGES * PAGE_SIZE) {
+        return EFAULT;
+    }
+    elo = kva_ptes[(vaddr - KVA_BASE) / PAGE_SIZE];
+    if ((elo & TLBLO_VALID) == 0) {
+        return EFAULT;
+    }
+
+    spl = splhigh();
+    tlb_prefill(vaddr & PAGE_FRAME, elo);
+    splx(spl);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* TLB replacement for entries loaded by vm_fault. See mips/tlb.h */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <uw-vmstats.h>
+#include "opt-tlbrr.h"
+
+/*
+ * Per-CPU state, only touched by its own CPU with interrupts off.
+ *
+ * Slots from tlb_freemark up have not been written by us since the
+ * TLB was last flushed, so they are probably still free; we only
+ * have to read the one we are about to use, not all NUM_TLB of them.
+ * (The UTLB refill handler may have put something there in the
+ * meantime, so we do check.)
+ */
+static uint32_t tlb_freemark[MAXCPUS];
+
+#if OPT_TLBRR
+/* Next slot to replace once the TLB is full */
+static uint32_t tlb_victim[MAXCPUS];
+#endif
+
+/*
+ * Write the entry into a free slot or the policy's victim. Returns
+ * true if the slot was free.
+ */
+static
+bool
+tlb_place(uint32_t entryhi, uint32_t entrylo)
+{
+    uint32_t ehi, elo, slot;
+    unsigned cpu;
+
+    cpu = curcpu->c_number;
+
+    while (tlb_freemark[cpu] < NUM_TLB) {
+        slot = tlb_freemark[cpu]++;
+        tlb_read(&ehi, &elo, slot);
+        if (!(elo & TLBLO_VALID)) {
+            tlb_write(entryhi, entrylo, slot);
+            return true;
+        }
+    }
+
+    #if OPT_TLBRR
+
+    /*
+     * Round robin: the slot we replace is the one we loaded longest
+     * ago, not wherever the random register happens to point, so the
+     * page we faulted on a moment ago (say, the stack) stays put.
+     * The slot may have been freed by a shootdown since.
+     */
+    slot = tlb_victim[cpu];
+    tlb_victim[cpu] = (slot + 1) % NUM_TLB;
+    tlb_read(&ehi, &elo, slot);
+    tlb_write(entryhi, entrylo, slot);
+    return !(elo & TLBLO_VALID);
+
+    #else
+
+    tlb_random(entryhi, entrylo);
+    return false;
+
+    #endif
+}
+
+void
+tlb_replace(uint32_t entryhi, uint32_t entrylo)
+{
+    if (tlb_place(entryhi, entrylo)) {
+        vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+    }
+    else {
+        vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+    }
+}
+
+void
+tlb_prefill(uint32_t entryhi, uint32_t entrylo)
+{
+    tlb_place(entryhi, entrylo);
+}
+
+void
+tlb_flushed(void)
+{
+    tlb_freemark[curcpu->c_number] = 0;
+}
@@ -44,6 +44,12 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <vm.h>
+#include <filecache.h>
+#include <objcache.h>
+#endif
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -79,6 +85,47 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * In-memory vnodes come from an object cache shared by all SFS
+ * volumes; it fits seven to a page where kmalloc would use a 1k
+ * block for each. It is made when the first vnode is loaded.
+ */
+static struct objcache *sfs_vnode_cache;
+#endif
+
+/* Get memory for a vnode. Call with the big lock held */
+static
+struct sfs_vnode *
+sfs_vnode_alloc(void)
+{
+#if OPT_A3
+	KASSERT(vfs_biglock_do_i_hold());
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = objcache_create("sfs_vnode",
+						  sizeof(struct sfs_vnode), 0,
+						  NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return NULL;
+		}
+	}
+	return objcache_alloc(sfs_vnode_cache);
+#else
+	return kmalloc(sizeof(struct sfs_vnode));
+#endif
+}
+
+static
+void
+sfs_vnode_free(struct sfs_vnode *sv)
+{
+#if OPT_A3
+	objcache_free(sfs_vnode_cache, sv);
+#else
+	kfree(sv);
+#endif
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
@@ -953,12 +1000,99 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_free(sv);
 
 	/* Done */
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Do I/O a page at a time, through the file page cache. A page that
+ * is cached (because somebody has it mapped, or is running it) is
+ * read out of or written into the cached frame, so that read(),
+ * write() and mmap() all see the same bytes; writes also go on to
+ * disk as usual. Pages that aren't cached go straight to sfs_io()
+ * and are not brought in.
+ *
+ * The cache is looked at without the big lock held, since filling
+ * it calls back into here.
+ */
+static
+int
+sfs_cachedio(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct iovec iov;
+	struct uio ku;
+	off_t pageoff, pos, size;
+	size_t len, rest, done;
+	paddr_t paddr;
+	char *page;
+	int result = 0, result2;
+
+	while (uio->uio_resid > 0 && result == 0) {
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pageoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		if (!filecache_lookup(v, uio->uio_offset - pageoff, &paddr)) {
+			/* Do just this page; put the rest back after */
+			rest = uio->uio_resid - len;
+			uio->uio_resid = len;
+			vfs_biglock_acquire();
+			result = sfs_io(sv, uio);
+			vfs_biglock_release();
+			done = len - uio->uio_resid;
+			uio->uio_resid += rest;
+			if (done < len) {
+				/* EOF (or an error) */
+				break;
+			}
+			continue;
+		}
+
+		page = (char *)PADDR_TO_KVADDR(paddr);
+		if (uio->uio_rw == UIO_READ) {
+			vfs_biglock_acquire();
+			size = sv->sv_i.sfi_size;
+			vfs_biglock_release();
+
+			if (uio->uio_offset >= size) {
+				free_kpages((vaddr_t)page);
+				break;
+			}
+			if ((off_t)len > size - uio->uio_offset) {
+				len = size - uio->uio_offset;
+			}
+			result = uiomove(page + pageoff, len, uio);
+		}
+		else {
+			/* Into the page, then whatever made it in to disk */
+			pos = uio->uio_offset;
+			rest = uio->uio_resid;
+			result = uiomove(page + pageoff, len, uio);
+			done = rest - uio->uio_resid;
+			if (done > 0) {
+				uio_kinit(&iov, &ku, page + pageoff, done, pos,
+					  UIO_WRITE);
+				vfs_biglock_acquire();
+				result2 = sfs_io(sv, &ku);
+				vfs_biglock_release();
+				if (result == 0) {
+					result = result2;
+				}
+			}
+		}
+		free_kpages((vaddr_t)page);
+	}
+
+	return result;
+}
+#endif
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -966,6 +1100,11 @@ static
 int
 sfs_read(struct vnode *v, struct uio *uio)
 {
+#if OPT_A3
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	return sfs_cachedio(v, uio);
+#else
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
@@ -976,6 +1115,7 @@ sfs_read(struct vnode *v, struct uio *uio)
 	vfs_biglock_release();
 
 	return result;
+#endif
 }
 
 /*
@@ -985,6 +1125,11 @@ static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
+#if OPT_A3
+	KASSERT(uio->uio_rw==UIO_WRITE);
+
+	return sfs_cachedio(v, uio);
+#else
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
@@ -995,6 +1140,7 @@ sfs_write(struct vnode *v, struct uio *uio)
 	vfs_biglock_release();
 
 	return result;
+#endif
 }
 
 /*
@@ -1117,7 +1263,15 @@ int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
+#if OPT_A3
+	/*
+	 * Mapped pages come out of the file page cache (see
+	 * sfs_cachedio), so there is nothing to set up here.
+	 */
+	return 0;
+#else
 	return EUNIMP;
+#endif
 }
 
 /*
@@ -1221,6 +1375,12 @@ sfs_truncate(struct vnode *v, off_t len)
 	sv->sv_dirty = true;
 
 	vfs_biglock_release();
+
+#if OPT_A3
+	/* Cached pages may hold data past the new end */
+	filecache_invalidate(v);
+#endif
+
 	return 0;
 }
 
@@ -1685,7 +1845,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = sfs_vnode_alloc();
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1859,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -1736,18 +1896,22 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
+#if OPT_A3
+	/* sfs_read and sfs_write go through cached pages */
+	sv->sv_v.vn_cachewrites = true;
+#endif
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		sfs_vnode_free(sv);
 		return result;
 	}
 
@@ -48,40 +48,89 @@ struct vnode;
  * 
  */
 
-struct addrspace {
-  /* Start Text segment */
-  vaddr_t as_vbase1;
+#if OPT_A3
+/*
+ * A region (segment) of an address space. Part of it may be backed
+ * by the executable; the rest is zero-filled. A region made by mmap
+ * is backed by rg_vnode instead, all of it, starting at file offset
+ * rg_fileoffset.
+ */
+struct region {
+  vaddr_t rg_vbase;             /* page aligned */
+  size_t rg_npages;
+  int rg_writeable;
+
+  /* File-backed part: rg_filesize bytes at rg_filevaddr, 0 if none */
+  vaddr_t rg_filevaddr;
+  off_t rg_fileoffset;
+  size_t rg_filesize;
+
+  /* Mapped file (holds a reference), or NULL; see as_mmap */
+  struct vnode *rg_vnode;
+  int rg_shared;                /* MAP_SHARED rather than MAP_PRIVATE */
+
+  /* Fault-around state, see vm_faultaround */
+  vaddr_t rg_falast;            /* last page vm_fault loaded */
+  vaddr_t rg_fanext;            /* where a walk would fault next */
+  int rg_fadir;                 /* direction of the walk, 1 or -1 */
+  unsigned rg_fawindow;         /* pages loaded along with the last */
+
+  struct region *rg_next;
+};
+#endif
 
+struct addrspace {
   #if OPT_A3
-  struct pagetable_entry* page_pbase1;
+  /* Text, data, stack, ... in no particular order */
+  struct region *as_regions;
+
+  /* Page table directory, PT_L1_SIZE entries (see pagetable.h) */
+  pte_t **as_pagedir;
+
+  /* The executable the file-backed regions come from */
+  struct vnode *as_file;
+
+  /*
+   * The heap, one of as_regions, and the break. The region covers the
+   * pages up to the break, rounded up; see as_sbrk.
+   */
+  struct region *as_heap;
+  vaddr_t as_heapend;
+
+  /* The stack, also one of as_regions; vm_fault extends it downwards */
+  struct region *as_stack;
+
+  /* Address space ID tagging our TLB entries, valid in as_asidgen */
+  uint32_t as_asid;
+  uint32_t as_asidgen;
+
+  /*
+   * Ring of the address spaces related to this one by fork, the only
+   * ones its private frames can be shared with (see pagetable_putref).
+   * Protected by coremap_lock.
+   */
+  struct addrspace *as_forknext;
+  struct addrspace *as_forkprev;
+
   #else
+  /* Start Text segment */
+  vaddr_t as_vbase1;
   paddr_t as_pbase1;
-  #endif
-
   size_t as_npages1;
   /* End Text segment */
 
 
   /* Start Data segment */
   vaddr_t as_vbase2;
-
-  #if OPT_A3
-  struct pagetable_entry* page_pbase2;
-  #else
   paddr_t as_pbase2;
-  #endif
-
   size_t as_npages2;
   /* End Data segment */
 
 
   /* Start Stack segment */
-  #if OPT_A3
-  struct pagetable_entry* page_stackpbase;
-  #else 
   paddr_t as_stackpbase;
-  #endif
   /* End stack segment */
+  #endif
 
 };
 
@@ -114,11 +163,31 @@ struct addrspace {
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up an empty heap above the segments.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The region grows down when faults land below it.
+ *
+ *    as_define_backing - record where in executable V the file-backed
+ *                part of the region containing VADDR lives. Nothing is
+ *                read until the pages are first touched.
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET into a new region
+ *                and hand back its address, which is HINT if that is
+ *                free. Writes to a SHARED mapping go to the file;
+ *                writes to a private one are copy-on-write.
+ *
+ *    as_munmap - remove the mapping at VADDR, which has to be a whole
+ *                mapping, writing back what was written to it first.
+ *
+ *    as_msync  - write back what was written to shared mappings in the
+ *                given range.
+ *
+ *    as_sbrk   - move the break by CHANGE bytes and hand back where it
+ *                was. Pages above the old break are filled in when
+ *                first touched; pages below the new one are freed.
  */
 
 struct addrspace *as_create(void);
@@ -136,6 +205,19 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if OPT_A3
+int               as_define_backing(struct addrspace *as,
+                                    struct vnode *v, off_t offset,
+                                    vaddr_t vaddr, size_t filesize);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, int writeable,
+                          int shared, vaddr_t hint, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sbrk(struct addrspace *as, intptr_t change,
+                          vaddr_t *ret);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -1,13 +1,70 @@
 #ifndef _COREMAP_H_
 #define _COREMAP_H_
 
+struct addrspace;
+
+/*
+ * One per frame, 16 bytes, so that an entry never straddles a cache
+ * line and the fault and allocation paths touch one line per frame.
+ * Frame indices fit in 20 bits (4G of memory), and no allocation is
+ * longer than a buddy block (1 << BUDDY_MAXORDER pages).
+ */
 struct coremap_entry
 { 
+    // user page living in this frame, for the page replacement code.
+    // NULL for kernel pages, frames shared copy-on-write and frames
+    // that are on their way in or out; none of those can be evicted.
+    // A shared frame gets its owner back once only one is left.
+    struct addrspace *as;
+
+    // virtual page number (vaddr / PAGE_SIZE) of that page. A kernel
+    // page has none, so on a subpage allocator page this holds the
+    // index of kmalloc's pageref for it instead.
+    uint32_t vpn:20;
+    // number of continuous allocation of pages. On the first page of
+    // a free buddy block this is the size of the block instead.
+    uint32_t count:11;
     // indicate if this entry(page) is being used
-    int used;
-    // number of continuous allocation of pages
-    unsigned long count;
+    uint32_t used:1;
+
+    // next frame on the buddy free list (first page of a free block)
+    // or on the zeroed page pool; COREMAP_NONE at the end. A user page
+    // whose entry has PTE_SWAPCOPY keeps its swap slot here instead.
+    uint32_t next:20;
+    // set whenever the page gets loaded into the TLB; the clock
+    // hand clears it and gives the page a second chance
+    uint32_t referenced:1;
+    // kmalloc size class + 1 of a subpage allocator page, else 0
+    uint32_t kmclass:5;
+    uint32_t :6;
+
+    union {
+        // number of owners sharing this allocation (first page only).
+        // Copy-on-write pages are shared by several page tables and
+        // only go back to the free pool when the last one lets go.
+        uint32_t refcount;
+        // previous frame on the buddy free list; free frames have no
+        // owners, so this shares the word
+        uint32_t prev;
+    };
 };
 
+/* Print how busy the coremap lock has been */
+void coremap_printstats(void);
+
+/* Number of owners of the allocation starting at PA, and adding one */
+unsigned long coremap_getref(paddr_t pa);
+void coremap_incref(paddr_t pa);
+
+/*
+ * Tag the kernel page at KVADDR with a kmalloc size class and the
+ * index of its pageref, and read the tag back without any locking.
+ * Pages outside KSEG0 always read as class 0. getkmtag returns false
+ * for pages from before the coremap existed, which it knows nothing
+ * about.
+ */
+void coremap_setkmtag(vaddr_t kvaddr, unsigned kmclass, unsigned kmref);
+bool coremap_getkmtag(vaddr_t kvaddr, unsigned *kmclass, unsigned *kmref);
+
 
 #endif  /*_COREMAP_H_*/
@@ -34,6 +34,15 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
+
+#if OPT_A3
+/* Free frames each cpu may keep for itself (see dumbvm.c) */
+#define CPU_PAGECACHE_MAX 16
+/* Subpage size classes with kmalloc magazines on each cpu (see kmalloc.c) */
+#define CPU_KMAG_CLASSES 16
+struct kmagazine;
+#endif
 
 
 /*
@@ -60,6 +69,17 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+#if OPT_A3
+	/* Only touched with interrupts off */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX]; /* Cached free frames */
+	unsigned c_npagecache;		/* Number of them */
+	uint32_t c_asid;		/* Address space ID in the MMU */
+	uint32_t c_asidgen;		/* ASID generation our TLB is from */
+	struct kmagazine *c_kmag[CPU_KMAG_CLASSES];	/* Loaded magazines */
+	struct kmagazine *c_kmagprev[CPU_KMAG_CLASSES];	/* Previous ones */
+	uint64_t c_kmallocs[CPU_KMAG_CLASSES];	/* kmalloc calls per size */
+	uint64_t c_kmbytes[CPU_KMAG_CLASSES];	/* Bytes they asked for */
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -86,6 +106,10 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+#if OPT_A3
+	uint32_t c_shootdowns_sent;	/* Shootdowns queued for this cpu */
+	uint32_t c_shootdowns_done;	/* Of those, how many it has done */
+#endif
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +133,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+#if OPT_A3
+/*
+ * Add up the kmalloc counters of all cpus into NALLOCS and NBYTES,
+ * CPU_KMAG_CLASSES entries each. The counts are read without locking,
+ * so they are only good enough for statistics.
+ */
+void cpu_kmstats(uint64_t *nallocs, uint64_t *nbytes);
+#endif
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +185,14 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current one.
+ * ipi_tlbflush_broadcast makes all CPUs except the current one flush
+ * their whole TLB, as if their shootdown queues had overflowed.
+ * ipi_tlbshootdown_wait waits until every other CPU has carried out
+ * all shootdowns sent to it so far. Only after that may a frame whose
+ * mapping was shot down be reused or written out. Call it at spl0
+ * with no spinlocks held, so that this CPU can still take the IPIs
+ * of others doing the same.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +207,11 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+#if OPT_A3
+void ipi_tlbflush_broadcast(void);
+void ipi_tlbshootdown_wait(void);
+#endif
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,64 @@
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+/*
+ * Cache of file pages, keyed by vnode and page-aligned file offset.
+ *
+ * Processes running the same executable map the same read-only text
+ * frames out of here instead of each reading a private copy, mmap
+ * maps file pages out of here, and SFS reads and writes go through
+ * whatever page is here, so all of them see the same bytes. The
+ * cache holds one reference on every frame it has (see the coremap's
+ * refcount) and each mapping holds another, so a frame stays as long
+ * as anybody uses it; frames only the cache still holds are given
+ * back when memory runs short, for the kernel as well as for users.
+ *
+ * Every cached page also holds a reference on its vnode, so that the
+ * pages outlive the programs using them: sh running ls over and over
+ * reads ls from disk only once. The references go with the pages, when
+ * memory runs short or the volume is unmounted. Until then a removed
+ * file keeps its blocks.
+ *
+ *    filecache_bootstrap  - set up. Called from vm_bootstrap.
+ *
+ *    filecache_get        - get the frame holding the page of VN at
+ *                           OFFSET, reading it in if it isn't cached.
+ *                           Bytes past the end of the file read as 0.
+ *                           The caller gets a reference of its own in
+ *                           RET, and HIT says whether the page was
+ *                           already there.
+ *
+ *    filecache_lookup     - like filecache_get, but only if the page
+ *                           is already cached; returns false if not.
+ *                           Used by the file system's own read and
+ *                           write, so it reports a miss, rather than
+ *                           waiting, for the page the calling thread
+ *                           is reading in.
+ *
+ *    filecache_invalidate - forget every page of VN, e.g. because
+ *                           the file was truncated or is going away.
+ *                           Frames still mapped stay with their users.
+ *
+ *    filecache_flushfs    - forget every page of the files on FS and
+ *                           let go of the files, so FS can be
+ *                           unmounted. Called from vfs_unmount with
+ *                           the vfs biglock held.
+ *
+ *    filecache_reclaim    - give back frames nobody maps any more.
+ *                           Returns how many were freed. May sleep;
+ *                           returns 0 straight away if the caller
+ *                           can't, or is the cache itself.
+ */
+
+struct vnode;
+struct fs;
+
+void filecache_bootstrap(void);
+int  filecache_get(struct vnode *vn, off_t offset, paddr_t *ret, bool *hit);
+bool filecache_lookup(struct vnode *vn, off_t offset, paddr_t *ret);
+void filecache_invalidate(struct vnode *vn);
+void filecache_flushfs(struct fs *fs);
+unsigned filecache_reclaim(void);
+
+
+#endif /*_FILECACHE_H_*/
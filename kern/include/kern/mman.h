@@ -0,0 +1,46 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap() and msync().
+ *
+ * There are no file handles yet, so mmap() itself is not there. For
+ * testing, the mmap_path call takes the path of the file to map
+ * where Unix takes a file descriptor:
+ *
+ *    void *mmap_path(void *addr, size_t len, int prot, int flags,
+ *                    const char *path, off_t offset);
+ *
+ * ADDR is only a hint. OFFSET has to be page aligned.
+ *
+ * So that tests can check a mapping against the file, there are also
+ * stand-ins for pread() and pwrite(), by path as well:
+ *
+ *    int pread_path(const char *path, void *buf, size_t len, off_t offset);
+ *    int pwrite_path(const char *path, const void *buf, size_t len,
+ *                    off_t offset);
+ *
+ * pwrite_path creates the file if need be. None of these are declared
+ * in any header; test programs declare them themselves.
+ */
+
+/* Protection, for mmap's PROT. The MIPS can only withhold write. */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Sharing, for mmap's FLAGS. Exactly one must be given. */
+#define MAP_SHARED    1      /* writes go to the file */
+#define MAP_PRIVATE   2      /* writes stay in this process */
+
+/* For msync's FLAGS. msync always waits for the writes anyway. */
+#define MS_ASYNC      1
+#define MS_SYNC       2
+#define MS_INVALIDATE 4
+
+/* What mmap() returns on failure */
+#define MAP_FAILED    ((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -196,6 +196,14 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_msync        121
+//                              (test only: mmap by path, for want of
+//                               a file table; leaves SYS_mmap alone)
+#define SYS_mmap_path    122
+//                              (test only: pread/pwrite by path, so that
+//                               tests can check mmap against the file)
+#define SYS_pread_path   123
+#define SYS_pwrite_path  124
 
 /*CALLEND*/
 
@@ -0,0 +1,38 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: slabs of same-sized objects, for structures that
+ * are created and destroyed all the time (threads, processes,
+ * vnodes).
+ *
+ * Objects are handed out already constructed. The constructor only
+ * runs when a new slab is made, and the destructor when a slab's page
+ * is given back, so whatever the constructor sets up (a stack, a cv)
+ * is reused from one user of an object to the next. Whoever frees an
+ * object must therefore leave it the way the constructor did.
+ *
+ *    objcache_create  - make a cache of SIZE-byte objects aligned to
+ *                       ALIGN, a power of two (0 for pointer
+ *                       alignment). CTOR and DTOR may be NULL; CTOR
+ *                       returns an error code. Objects must fit a few
+ *                       to a page. Returns NULL if out of memory.
+ *
+ *    objcache_alloc   - get a constructed object, or NULL if out of
+ *                       memory. May sleep if the constructor does.
+ *
+ *    objcache_free    - give an object back.
+ *
+ *    objcache_destroy - free a cache nothing is allocated from.
+ */
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t size, size_t align,
+                                 int (*ctor)(void *obj),
+                                 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+#endif /* _OBJCACHE_H_ */
@@ -1,11 +1,43 @@
 #ifndef _PAGETABLE_H_
 #define _PAGETABLE_H_
 
-struct pagetable_entry
-{ 
-    // Corresponding physical address
-    paddr_t paddr;
-};
+#include <vm.h>
+#include <mips/tlb.h>
+
+/*
+ * Two-level page table covering the user half of the address space.
+ *
+ * The directory has one slot per 4M of address space, pointing at a
+ * page-sized table of PT_L2_SIZE entries, or NULL if nothing in that
+ * 4M has been touched yet.
+ *
+ * Entries are laid out like the TLB's EntryLo, so that once the
+ * software bits are masked off they can be loaded as they are:
+ *    TLBLO_PPAGE - the physical frame, or the swap slot if PTE_SWAPPED
+ *    TLBLO_DIRTY - the page may be written right now
+ *    TLBLO_VALID - the page is resident and may be loaded into the TLB
+ * The software bits live in the low byte, which the TLB does not use.
+ * An entry of 0 is a page that has never been touched.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_COW       0x00000001  /* frame is shared copy-on-write */
+#define PTE_SWAPPED   0x00000002  /* page is out in swap */
+#define PTE_BUSY      0x00000004  /* page is being evicted; wait for it */
+#define PTE_SHARED    0x00000008  /* page of a shared mapping; never evicted */
+#define PTE_SWAPCOPY  0x00000010  /* clean; swap slot cme->next still has it */
+#define PTE_SWBITS    0x000000ff
+
+#define PTE_PADDR(pte)     ((pte) & TLBLO_PPAGE)
+#define PTE_RESIDENT(pte)  (!((pte) & PTE_SWAPPED) && PTE_PADDR(pte) != 0)
+#define PTE_SWAPSLOT(pte)  ((pte) >> 12)
+#define PTE_MKSWAP(slot)   (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_L1_SHIFT       22
+#define PT_L1_SIZE        (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_SIZE        (PAGE_SIZE / sizeof(pte_t))
+#define PT_L1_INDEX(va)   ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)   (((va) / PAGE_SIZE) & (PT_L2_SIZE - 1))
 
 
 #endif /*_PAGETABLE_H_*/
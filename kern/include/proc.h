@@ -86,11 +86,6 @@ struct proc {
    struct cv* wait_child;
 #endif
 
-#ifdef OPT_A3
-   /* This is to indicate if this process has alreday been loaded by loadelf */
-   /* We need this to decide whether we should set TLBLO_DIRTY bit for text segment in TLB */
-   int loaded;
-#endif
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -0,0 +1,33 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for user pages.
+ *
+ * The swap area is the raw disk SWAP_DEVICE, cut into page-sized
+ * slots. If the device is missing the system simply runs without
+ * swap and swap_out always fails.
+ *
+ *    swap_bootstrap - open the swap device. Called from vm_bootstrap.
+ *
+ *    swap_out  - write the page at PADDR to a free slot, handing the
+ *                slot number back in SLOT.
+ *
+ *    swap_in   - read slot SLOT into the page at PADDR. The slot stays
+ *                allocated.
+ *
+ *    swap_free - give SLOT back.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+/* Slot numbers have to fit in a page table entry's frame bits */
+#define SWAP_MAXSLOTS (1U << 20)
+
+void swap_bootstrap(void);
+int  swap_out(paddr_t paddr, unsigned *slot);
+int  swap_in(unsigned slot, paddr_t paddr);
+void swap_free(unsigned slot);
+
+
+#endif /*_SWAP_H_*/
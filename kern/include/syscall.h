@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -71,4 +72,16 @@ int sys_fork(struct trapframe* tf, pid_t* retval);
 int sys_execv(const char* program, char** args);
 #endif
 
+#if OPT_A3
+int sys_mmap_path(userptr_t addr, size_t len, int prot, int flags,
+                  userptr_t path, off_t offset, vaddr_t *retval);
+int sys_pread_path(userptr_t path, userptr_t buf, size_t len, off_t offset,
+                   int *retval);
+int sys_pwrite_path(userptr_t path, userptr_t buf, size_t len, off_t offset,
+                    int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+int sys_sbrk(intptr_t change, vaddr_t *retval);
+#endif
+
 #endif /* _SYSCALL_H_ */
@@ -78,6 +78,7 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocsmallstress(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
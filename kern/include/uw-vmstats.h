@@ -40,7 +40,7 @@
 
 /* ----------------------------------------------------------------------- */
 
-/* Initialize the statistics: must be called before using */
+/* Initialize the statistics: called once, from vm_bootstrap */
 void vmstats_init(void);                     /* uses locking */
 void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
 
@@ -52,7 +52,17 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
-/* Print the statistics: assumes that at least vmstats_init has been called */
+/* Print the statistics since boot */
 void vmstats_print(void);                    /* Does NOT use locking */
 
+/* Copy out the current totals, to print how they changed later
+ * Example use:
+ *   unsigned int before[VMSTAT_COUNT];
+ *   vmstats_snapshot(before);
+ *   ...
+ *   vmstats_print_since(before);
+ */
+void vmstats_snapshot(unsigned int *counts); /* Does NOT use locking */
+void vmstats_print_since(const unsigned int *since); /* Does NOT use locking */
+
 #endif /* VM_STATS_H */
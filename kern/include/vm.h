@@ -55,6 +55,19 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Like alloc_kpages, but only ever a run of NPAGES frames in KSEG0,
+ * never pages mapped through KSEG2; returns 0 if there is no such run.
+ */
+vaddr_t alloc_kpages_contig(int npages);
+
+/*
+ * Background work for a cpu with nothing to run, called from the idle
+ * loop with interrupts off. Returns nonzero if it did something, zero
+ * if the cpu may as well halt.
+ */
+int vm_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
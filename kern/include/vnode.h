@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include "opt-A3.h"
 
 struct uio;
 struct stat;
@@ -50,6 +51,10 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_cachewrites is set by file systems whose writes go through the
+ * file page cache (see filecache.h). vfs_open drops the cached pages
+ * of any other file opened for writing, since they would go stale.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
@@ -60,6 +65,9 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+#if OPT_A3
+	bool vn_cachewrites;            /* Writes update the file cache */
+#endif
 };
 
 /*
@@ -54,6 +54,10 @@
 #include <limits.h>
 #include <lib.h>
 /***********************************/
+#include "opt-A3.h"
+#if OPT_A3
+#include <objcache.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -87,6 +91,36 @@ struct lock* global_mutex;
 #endif
 
 
+#if OPT_A3
+/*
+ * Procs come out of an object cache. The wait_child cv is only
+ * created the first time a proc is used for a user process, and then
+ * stays with it from one process to the next.
+ */
+static struct objcache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+    struct proc *proc = obj;
+
+    proc->wait_child = NULL;
+    return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+    struct proc *proc = obj;
+
+    if (proc->wait_child != NULL) {
+        cv_destroy(proc->wait_child);
+    }
+}
+#endif
+
 /*
  * Create a proc structure.
  */
@@ -96,13 +130,21 @@ proc_create(const char *name)
 {
     struct proc *proc;
 
+#if OPT_A3
+    proc = objcache_alloc(proc_cache);
+#else
     proc = kmalloc(sizeof(*proc));
+#endif
     if (proc == NULL) {
         return NULL;
     }
     proc->p_name = kstrdup(name);
     if (proc->p_name == NULL) {
+#if OPT_A3
+        objcache_free(proc_cache, proc);
+#else
         kfree(proc);
+#endif
         return NULL;
     }
 
@@ -187,14 +229,24 @@ proc_destroy(struct proc *proc)
     if(proc->pid == current_largest_pid) {
         --current_largest_pid;
     }
+#if OPT_A3
+    /* The cv stays for the next process; see proc_dtor */
+    kfree(proc->p_name);
+    objcache_free(proc_cache, proc);
+#else
     cv_destroy(proc->wait_child);
     kfree(proc->p_name);
     kfree(proc);
+#endif
     //lock_release(global_mutex);
 #else
     kfree(proc->p_name);
+#if OPT_A3
+    objcache_free(proc_cache, proc);
+#else
     kfree(proc);
 #endif
+#endif
 
 
 #ifdef UW
@@ -221,6 +273,13 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+#if OPT_A3
+  proc_cache = objcache_create("proc", sizeof(struct proc), 0,
+                               proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("objcache_create for procs failed\n");
+  }
+#endif
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -268,12 +327,22 @@ proc_create_runprogram(const char *name)
     }
 
 #ifdef OPT_A2
+#if OPT_A3
+   if(proc->wait_child == NULL) {
+      proc->wait_child = cv_create("");
+   }
+#else
    proc->wait_child = cv_create("");
+#endif
    if(proc->wait_child == NULL) {
          threadarray_cleanup(&proc->p_threads);
       spinlock_cleanup(&proc->p_lock);
       kfree(proc->p_name);
+#if OPT_A3
+      objcache_free(proc_cache, proc);
+#else
       kfree(proc);
+#endif
          // TODO here 
          return NULL;
    }
@@ -283,10 +352,6 @@ proc_create_runprogram(const char *name)
    proc->exitcode = 0;
 #endif
 
-#ifdef OPT_A3
-   proc->loaded = false;
-#endif
-
 #ifdef UW
     /* open the console - this should always succeed */
     console_path = kstrdup("con:");
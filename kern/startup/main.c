@@ -50,6 +50,11 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#include <coremap.h>
+#endif
 
 
 /*
@@ -146,6 +151,12 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+
+#if OPT_A3
+	/* Report TLB, page fault and swap activity for the whole run */
+	vmstats_print();
+	coremap_printstats();
+#endif
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
@@ -45,6 +45,10 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -132,12 +136,20 @@ common_prog(int nargs, char **args)
 {
 	struct proc *proc;
 	int result;
+#if OPT_A3
+	unsigned int stats[VMSTAT_COUNT];
+#endif
 
 #if OPT_SYNCHPROBS
 	kprintf("Warning: this probably won't work with a "
 		"synchronization-problems kernel.\n");
 #endif
 
+#if OPT_A3
+	/* So we can say what the program did to the VM system */
+	vmstats_snapshot(stats);
+#endif
+
 	/* Create a process for the new program to run in. */
 	proc = proc_create_runprogram(args[0] /* name */);
 	if (proc == NULL) {
@@ -158,6 +170,9 @@ common_prog(int nargs, char **args)
 	/* wait until the process we have just launched - and any others that it 
 	   may fork - is finished before proceeding */
 	P(no_proc_sem);
+#if OPT_A3
+	vmstats_print_since(stats);
+#endif
 #endif // UW
 
 	return 0;
@@ -474,6 +489,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc small-block stress    ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -585,6 +601,7 @@ static struct {
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocsmallstress },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
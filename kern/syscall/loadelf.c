@@ -85,9 +85,11 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if !OPT_A3
 	struct iovec iov;
 	struct uio u;
 	int result;
+#endif
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
@@ -97,6 +99,16 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if OPT_A3
+	/*
+	 * Pages are demand-loaded: vm_fault reads each one from the
+	 * file the first time it is touched. All we do here is tell
+	 * the address space where the segment lives on disk.
+	 */
+	(void)is_executable;
+
+	return as_define_backing(as, v, offset, vaddr, filesize);
+#else
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -147,6 +159,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
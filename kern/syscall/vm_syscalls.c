@@ -0,0 +1,168 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <limits.h>
+#include <uio.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <vfs.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+
+/* handler for mmap_path() system call               */
+/*
+ * For testing: there is no file table, so the file is named by PATH
+ * rather than by a descriptor, under a name of its own so that a real
+ * mmap() can come later. It is opened just long enough for as_mmap
+ * to take a reference of its own.
+ */
+int
+sys_mmap_path(userptr_t addr, size_t len, int prot, int flags,
+              userptr_t path, off_t offset, vaddr_t *retval)
+{
+  struct vnode *v;
+  char *kpath;
+  int shared;
+  int result;
+
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+    return EINVAL;
+  }
+  if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+    return EINVAL;
+  }
+  shared = flags == MAP_SHARED;
+
+  kpath = kmalloc(PATH_MAX);
+  if (kpath == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(path, kpath, PATH_MAX, NULL);
+  if (result) {
+    kfree(kpath);
+    return result;
+  }
+
+  /* Only a shared mapping can write to the file */
+  result = vfs_open(kpath,
+                    (shared && (prot & PROT_WRITE)) ? O_RDWR : O_RDONLY,
+                    0, &v);
+  kfree(kpath);
+  if (result) {
+    return result;
+  }
+
+  result = VOP_MMAP(v);
+  if (result == 0) {
+    result = as_mmap(curproc_getas(), v, offset, len,
+                     (prot & PROT_WRITE) != 0, shared,
+                     (vaddr_t)addr, retval);
+  }
+  vfs_close(v);
+  return result;
+}
+
+/*
+ * For testing as well: read or write LEN bytes of the file at PATH,
+ * starting at OFFSET, the way pread() and pwrite() would. These go
+ * through the same file cache pages as mappings of the file do.
+ */
+static
+int
+file_rw_path(userptr_t path, userptr_t buf, size_t len, off_t offset,
+             enum uio_rw rw, int *retval)
+{
+  struct vnode *v;
+  struct iovec iov;
+  struct uio u;
+  char *kpath;
+  int result;
+
+  if (offset < 0) {
+    return EINVAL;
+  }
+
+  kpath = kmalloc(PATH_MAX);
+  if (kpath == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(path, kpath, PATH_MAX, NULL);
+  if (result) {
+    kfree(kpath);
+    return result;
+  }
+
+  result = vfs_open(kpath, rw == UIO_READ ? O_RDONLY : O_WRONLY | O_CREAT,
+                    0664, &v);
+  kfree(kpath);
+  if (result) {
+    return result;
+  }
+
+  iov.iov_ubase = buf;
+  iov.iov_len = len;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = offset;
+  u.uio_resid = len;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc_getas();
+
+  result = rw == UIO_READ ? VOP_READ(v, &u) : VOP_WRITE(v, &u);
+  vfs_close(v);
+  if (result) {
+    return result;
+  }
+  *retval = len - u.uio_resid;
+  return 0;
+}
+
+/* handler for pread_path() system call              */
+int
+sys_pread_path(userptr_t path, userptr_t buf, size_t len, off_t offset,
+               int *retval)
+{
+  return file_rw_path(path, buf, len, offset, UIO_READ, retval);
+}
+
+/* handler for pwrite_path() system call             */
+int
+sys_pwrite_path(userptr_t path, userptr_t buf, size_t len, off_t offset,
+                int *retval)
+{
+  return file_rw_path(path, buf, len, offset, UIO_WRITE, retval);
+}
+
+/* handler for munmap() system call                  */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  return as_munmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+/* handler for msync() system call                   */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+  if (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) {
+    return EINVAL;
+  }
+  return as_msync(curproc_getas(), (vaddr_t)addr, len);
+}
+
+/* handler for sbrk() system call                    */
+int
+sys_sbrk(intptr_t change, vaddr_t *retval)
+{
+  return as_sbrk(curproc_getas(), change, retval);
+}
+
+#endif /* OPT_A3 */
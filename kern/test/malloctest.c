@@ -45,12 +45,20 @@
  *
  * mallocstress does the same thing, but from NTHREADS different
  * threads at once.
+ *
+ * mallocsmallstress has NTHREADS threads allocate and free batches
+ * of small blocks of assorted sizes, the way thread, lock and vnode
+ * creation does. It is for timing the allocator more than for
+ * testing it; the menu prints how long it took.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+#define NSMALLROUNDS  2000
+#define NSMALLBATCH   24
+
 static
 void
 mallocthread(void *sm, unsigned long num)
@@ -137,3 +145,67 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+static
+void
+mallocsmallthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[NSMALLBATCH];
+	int i, j;
+
+	for (i=0; i<NSMALLROUNDS; i++) {
+		for (j=0; j<NSMALLBATCH; j++) {
+			/* 16 to 512 bytes, a different mix in each thread */
+			ptrs[j] = kmalloc(16 << ((j + num) % 6));
+			if (ptrs[j]==NULL) {
+				kprintf("thread %lu: kmalloc returned NULL\n",
+					num);
+				while (j-- > 0) {
+					kfree(ptrs[j]);
+				}
+				V(sem);
+				return;
+			}
+		}
+		for (j=0; j<NSMALLBATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+	V(sem);
+}
+
+int
+mallocsmallstress(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocsmallstress", 0);
+	if (sem == NULL) {
+		panic("mallocsmallstress: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc small-block stress test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("mallocsmallstress", NULL,
+				     mallocsmallthread, sem, i);
+		if (result) {
+			panic("mallocsmallstress: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc small-block stress test done\n");
+
+	return 0;
+}
@@ -48,10 +48,15 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <objcache.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -115,6 +120,71 @@ thread_checkstack(struct thread *thread)
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
  */
+#if OPT_A3
+/*
+ * Threads come out of an object cache. A thread's kernel stack stays
+ * with it when it is freed, so that the next thread_fork to get the
+ * same struct thread doesn't have to allocate one. The cache can hold
+ * on to free threads for a long time, though, so only the first
+ * THREAD_CACHEDSTACKS of them keep their stacks; the rest give them
+ * back. thread_cachedstacks counts the free threads that have one.
+ */
+#define THREAD_CACHEDSTACKS 4
+
+static struct objcache *thread_cache;
+static struct spinlock thread_stacklock = SPINLOCK_INITIALIZER;
+static unsigned thread_cachedstacks;
+
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		KASSERT(thread_cachedstacks > 0);
+		thread_cachedstacks--;
+		spinlock_release(&thread_stacklock);
+
+		kfree(thread->t_stack);
+	}
+}
+
+/* Give THREAD back to the cache, with its stack if there's room */
+static
+void
+thread_putcache(struct thread *thread)
+{
+	bool keep;
+
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		keep = thread_cachedstacks < THREAD_CACHEDSTACKS;
+		if (keep) {
+			thread_cachedstacks++;
+		}
+		spinlock_release(&thread_stacklock);
+
+		if (!keep) {
+			kfree(thread->t_stack);
+			thread->t_stack = NULL;
+		}
+	}
+	objcache_free(thread_cache, thread);
+}
+#endif
+
 static
 struct thread *
 thread_create(const char *name)
@@ -123,14 +193,30 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
+#if OPT_A3
+	thread = objcache_alloc(thread_cache);
+#else
 	thread = kmalloc(sizeof(*thread));
+#endif
 	if (thread == NULL) {
 		return NULL;
 	}
+#if OPT_A3
+	if (thread->t_stack != NULL) {
+		spinlock_acquire(&thread_stacklock);
+		KASSERT(thread_cachedstacks > 0);
+		thread_cachedstacks--;
+		spinlock_release(&thread_stacklock);
+	}
+#endif
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
+#if OPT_A3
+		thread_putcache(thread);
+#else
 		kfree(thread);
+#endif
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,7 +225,10 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
+#if !OPT_A3
+	/* (With OPT_A3 it may still have the last user's stack) */
 	thread->t_stack = NULL;
+#endif
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -168,6 +257,9 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+#if OPT_A3
+	unsigned i;
+#endif
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,6 +272,17 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+#if OPT_A3
+	c->c_npagecache = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
+	for (i=0; i<CPU_KMAG_CLASSES; i++) {
+		c->c_kmag[i] = NULL;
+		c->c_kmagprev[i] = NULL;
+		c->c_kmallocs[i] = 0;
+		c->c_kmbytes[i] = 0;
+	}
+#endif
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -187,6 +290,10 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+#if OPT_A3
+	c->c_shootdowns_sent = 0;
+	c->c_shootdowns_done = 0;
+#endif
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -214,7 +321,13 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
+#if OPT_A3
+		if (c->c_curthread->t_stack == NULL) {
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		}
+#else
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -227,6 +340,27 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+#if OPT_A3
+void
+cpu_kmstats(uint64_t *nallocs, uint64_t *nbytes)
+{
+	unsigned i, j;
+	struct cpu *c;
+
+	for (j=0; j<CPU_KMAG_CLASSES; j++) {
+		nallocs[j] = 0;
+		nbytes[j] = 0;
+	}
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		for (j=0; j<CPU_KMAG_CLASSES; j++) {
+			nallocs[j] += c->c_kmallocs[j];
+			nbytes[j] += c->c_kmbytes[j];
+		}
+	}
+}
+#endif
+
 /*
  * Destroy a thread.
  *
@@ -249,9 +383,12 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
+#if !OPT_A3
+	/* (With OPT_A3 the stack may stay for the next user; see thread_putcache) */
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+#endif
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +396,11 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+#if OPT_A3
+	thread_putcache(thread);
+#else
 	kfree(thread);
+#endif
 }
 
 /*
@@ -351,6 +492,14 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+#if OPT_A3
+	thread_cache = objcache_create("thread", sizeof(struct thread), 0,
+				       thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+#endif
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -492,8 +641,14 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
+	/* Allocate a stack, unless it still has one */
+#if OPT_A3
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+	}
+#else
 	newthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -635,7 +790,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			/* Zero some pages first; halt once there's nothing left */
+			if (!vm_idle()) {
+				cpu_idle();
+			}
+#else
 			cpu_idle();
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1151,10 +1313,13 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
-	else {
+	else if (n != TLBSHOOTDOWN_ALL) {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+#if OPT_A3
+	target->c_shootdowns_sent++;
+#endif
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1162,6 +1327,70 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
+#if OPT_A3
+void
+ipi_tlbflush_broadcast(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		spinlock_acquire(&c->c_ipi_lock);
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_shootdowns_sent++;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
+
+void
+ipi_tlbshootdown_wait(void)
+{
+	unsigned i;
+	struct cpu *c;
+	uint32_t sent, done;
+
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		sent = c->c_shootdowns_sent;
+		spinlock_release(&c->c_ipi_lock);
+
+		/* Spin; it is at most one interrupt's worth of work */
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			done = c->c_shootdowns_done;
+			spinlock_release(&c->c_ipi_lock);
+		} while ((int32_t)(done - sent) < 0);
+	}
+}
+#endif
+
 void
 interprocessor_interrupt(void)
 {
@@ -1202,6 +1431,9 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+#if OPT_A3
+		curcpu->c_shootdowns_done = curcpu->c_shootdowns_sent;
+#endif
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include "opt-A3.h"
 
 /*
  * Called for each open().
@@ -249,7 +250,12 @@ int
 dev_mmap(struct vnode *v  /* add stuff as needed */)
 {
 	(void)v;
+#if OPT_A3
+	/* None of ours can be mapped yet */
+	return ENODEV;
+#else
 	return EUNIMP;
+#endif
 }
 
 /*
@@ -43,6 +43,10 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <filecache.h>
+#endif
 
 /*
  * Structure for a single named device.
@@ -576,6 +580,11 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
+#if OPT_A3
+	/* Cached pages hold references on the files */
+	filecache_flushfs(kd->kd_fs);
+#endif
+
 	result = FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -633,6 +642,10 @@ vfs_unmountall(void)
 			}
 		}
 
+#if OPT_A3
+		filecache_flushfs(dev->kd_fs);
+#endif
+
 		result = FSOP_UNMOUNT(dev->kd_fs);
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n", 
@@ -38,6 +38,10 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <filecache.h>
+#endif
 
 
 /* Does most of the work for open(). */
@@ -94,6 +98,13 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 	}
 
 	VOP_INCOPEN(vn);
+
+#if OPT_A3
+	if (canwrite && !vn->vn_cachewrites) {
+		/* Writes will go around the cache; don't serve old pages */
+		filecache_invalidate(vn);
+	}
+#endif
 	
 	if (openflags & O_TRUNC) {
 		if (canwrite==0) {
@@ -36,6 +36,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include "opt-A3.h"
 
 /*
  * Initialize an abstract vnode.
@@ -53,6 +54,9 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_opencount = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+#if OPT_A3
+	vn->vn_cachewrites = false;
+#endif
 	return 0;
 }
 
@@ -0,0 +1,385 @@
+/* Cache of file pages, for text and mmap. See filecache.h */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <coremap.h>
+#include <filecache.h>
+
+#define FILECACHE_BUCKETS 64
+
+struct filecache_page {
+    struct vnode *fp_vnode;     /* holds a reference; see filecache.h */
+    off_t fp_offset;            /* page aligned */
+    paddr_t fp_paddr;           /* holds a reference too; 0 while read in */
+    struct thread *fp_reader;   /* who is reading it in */
+    struct filecache_page *fp_next;
+};
+
+static struct filecache_page *filecache_table[FILECACHE_BUCKETS];
+
+/*
+ * Protects the table; it also means a frame's refcount can only go
+ * up from 1 while we hold it. Pages are read in without it held
+ * (the read goes through the file system, which looks in here), so
+ * a page being read in has no frame yet, and anybody else who wants
+ * it waits on filecache_cv.
+ */
+static struct lock *filecache_lock;
+static struct cv *filecache_cv;
+
+/*
+ * Pages whose frames are already given back but whose vnode reference
+ * is still to be dropped, linked through fp_next. Letting go of the
+ * last reference reclaims the vnode, which must not happen in the
+ * middle of some file system operation of the caller's; see
+ * filecache_release. Protected by filecache_lock.
+ */
+static struct filecache_page *filecache_deferred;
+
+void
+filecache_bootstrap(void)
+{
+    filecache_lock = lock_create("filecache");
+    filecache_cv = cv_create("filecache");
+    if (filecache_lock == NULL || filecache_cv == NULL) {
+        panic("filecache: out of memory for the lock\n");
+    }
+}
+
+static
+unsigned
+filecache_hash(struct vnode *vn, off_t offset)
+{
+    return (((uintptr_t)vn >> 4) ^ (unsigned)(offset / PAGE_SIZE))
+        % FILECACHE_BUCKETS;
+}
+
+/* Find the page of VN at OFFSET. Call with the lock held */
+static
+struct filecache_page *
+filecache_find(struct vnode *vn, off_t offset)
+{
+    struct filecache_page *fp;
+
+    fp = filecache_table[filecache_hash(vn, offset)];
+    while (fp != NULL) {
+        if (fp->fp_vnode == vn && fp->fp_offset == offset) {
+            return fp;
+        }
+        fp = fp->fp_next;
+    }
+    return NULL;
+}
+
+/* Take FP off the table. Call with the lock held */
+static
+void
+filecache_remove(struct filecache_page *fp)
+{
+    struct filecache_page **fpp;
+
+    fpp = &filecache_table[filecache_hash(fp->fp_vnode, fp->fp_offset)];
+    while (*fpp != fp) {
+        fpp = &(*fpp)->fp_next;
+    }
+    *fpp = fp->fp_next;
+}
+
+/*
+ * Drop the cache's hold on the pages on list FP, which are already
+ * off the table: their frames, and their vnode references. Called
+ * without the lock, as letting go of the last reference to a vnode
+ * goes back into the file system. A thread holding the vfs biglock
+ * may be part way through a file system operation, so for it the
+ * references are left on filecache_deferred instead.
+ */
+static
+void
+filecache_release(struct filecache_page *fp)
+{
+    struct filecache_page *next;
+    bool defer;
+
+    defer = vfs_biglock_do_i_hold();
+    while (fp != NULL) {
+        next = fp->fp_next;
+        free_kpages(PADDR_TO_KVADDR(fp->fp_paddr));
+        if (defer) {
+            lock_acquire(filecache_lock);
+            fp->fp_next = filecache_deferred;
+            filecache_deferred = fp;
+            lock_release(filecache_lock);
+        }
+        else {
+            VOP_DECREF(fp->fp_vnode);
+            kfree(fp);
+        }
+        fp = next;
+    }
+}
+
+/*
+ * Drop the vnode references filecache_release had to leave behind.
+ * Called without the lock, and without the vfs biglock unless the
+ * caller means it (see filecache_flushfs).
+ */
+static
+void
+filecache_drain(void)
+{
+    struct filecache_page *fp, *next;
+
+    lock_acquire(filecache_lock);
+    fp = filecache_deferred;
+    filecache_deferred = NULL;
+    lock_release(filecache_lock);
+
+    while (fp != NULL) {
+        next = fp->fp_next;
+        VOP_DECREF(fp->fp_vnode);
+        kfree(fp);
+        fp = next;
+    }
+}
+
+/*
+ * Take pages off the table: every page of VN if VN is set, every page
+ * of a file on FS if FS is set, and otherwise every page nobody else
+ * has mapped. Pages still being read in stay. Returns them as a list.
+ * Call with the lock held.
+ */
+static
+struct filecache_page *
+filecache_collect(struct vnode *vn, struct fs *fs, unsigned *count)
+{
+    struct filecache_page *fp, **fpp, *list;
+    unsigned i;
+
+    list = NULL;
+    *count = 0;
+    for (i = 0; i < FILECACHE_BUCKETS; i++) {
+        fpp = &filecache_table[i];
+        while (*fpp != NULL) {
+            fp = *fpp;
+            if (fp->fp_paddr != 0 &&
+                (vn != NULL ? fp->fp_vnode == vn :
+                 fs != NULL ? fp->fp_vnode->vn_fs == fs :
+                 coremap_getref(fp->fp_paddr) == 1)) {
+                *fpp = fp->fp_next;
+                fp->fp_next = list;
+                list = fp;
+                (*count)++;
+            }
+            else {
+                fpp = &fp->fp_next;
+            }
+        }
+    }
+    return list;
+}
+
+/* Read the page of VN at OFFSET into a new frame */
+static
+int
+filecache_read(struct vnode *vn, off_t offset, paddr_t *ret)
+{
+    struct filecache_page *list;
+    struct iovec iov;
+    struct uio u;
+    unsigned n;
+    vaddr_t kva;
+    int result;
+
+    kva = alloc_kpages(1);
+    if (kva == 0) {
+        lock_acquire(filecache_lock);
+        list = filecache_collect(NULL, NULL, &n);
+        lock_release(filecache_lock);
+        filecache_release(list);
+        if (n > 0) {
+            kva = alloc_kpages(1);
+        }
+    }
+    if (kva == 0) {
+        return ENOMEM;
+    }
+
+    uio_kinit(&iov, &u, (void *)kva, PAGE_SIZE, offset, UIO_READ);
+    result = VOP_READ(vn, &u);
+    if (result) {
+        free_kpages(kva);
+        return result;
+    }
+
+    /* Short read at the end of the file */
+    bzero((void *)(kva + PAGE_SIZE - u.uio_resid), u.uio_resid);
+
+    *ret = KVADDR_TO_PADDR(kva);
+    return 0;
+}
+
+int
+filecache_get(struct vnode *vn, off_t offset, paddr_t *ret, bool *hit)
+{
+    struct filecache_page *fp;
+    unsigned h;
+    paddr_t paddr;
+    int result;
+
+    KASSERT(offset % PAGE_SIZE == 0);
+
+    /* A good time to let go of files reclaimed under pressure */
+    if (filecache_deferred != NULL && !vfs_biglock_do_i_hold()) {
+        filecache_drain();
+    }
+
+    h = filecache_hash(vn, offset);
+
+    lock_acquire(filecache_lock);
+
+    fp = filecache_find(vn, offset);
+    while (fp != NULL && fp->fp_paddr == 0) {
+        /* Somebody else is reading it in; it may not work out */
+        cv_wait(filecache_cv, filecache_lock);
+        fp = filecache_find(vn, offset);
+    }
+    if (fp != NULL) {
+        coremap_incref(fp->fp_paddr);
+        *ret = fp->fp_paddr;
+        *hit = true;
+        lock_release(filecache_lock);
+        return 0;
+    }
+
+    fp = kmalloc(sizeof(struct filecache_page));
+    if (fp == NULL) {
+        lock_release(filecache_lock);
+        return ENOMEM;
+    }
+    fp->fp_vnode = vn;
+    fp->fp_offset = offset;
+    fp->fp_paddr = 0;
+    fp->fp_reader = curthread;
+    fp->fp_next = filecache_table[h];
+    filecache_table[h] = fp;
+    lock_release(filecache_lock);
+
+    /*
+     * The page's reference, taken without filecache_lock (the biglock
+     * comes first). Nobody takes a page off the table before it has
+     * a frame, so nothing can drop it before this.
+     */
+    VOP_INCREF(vn);
+
+    result = filecache_read(vn, offset, &paddr);
+
+    lock_acquire(filecache_lock);
+    if (result) {
+        filecache_remove(fp);
+    }
+    else {
+        /* One reference for the cache, one for the caller */
+        fp->fp_paddr = paddr;
+        coremap_incref(paddr);
+        *ret = paddr;
+        *hit = false;
+    }
+    cv_broadcast(filecache_cv, filecache_lock);
+    lock_release(filecache_lock);
+
+    if (result) {
+        VOP_DECREF(vn);
+        kfree(fp);
+    }
+    return result;
+}
+
+bool
+filecache_lookup(struct vnode *vn, off_t offset, paddr_t *ret)
+{
+    struct filecache_page *fp;
+
+    KASSERT(offset % PAGE_SIZE == 0);
+
+    lock_acquire(filecache_lock);
+    fp = filecache_find(vn, offset);
+    while (fp != NULL && fp->fp_paddr == 0 && fp->fp_reader != curthread) {
+        cv_wait(filecache_cv, filecache_lock);
+        fp = filecache_find(vn, offset);
+    }
+    if (fp == NULL || fp->fp_paddr == 0) {
+        /* Not cached, or this is our own read filling it in */
+        lock_release(filecache_lock);
+        return false;
+    }
+    coremap_incref(fp->fp_paddr);
+    *ret = fp->fp_paddr;
+    lock_release(filecache_lock);
+    return true;
+}
+
+void
+filecache_invalidate(struct vnode *vn)
+{
+    struct filecache_page *list;
+    unsigned n;
+
+    if (filecache_lock == NULL) {
+        /* Files touched before the VM system is up */
+        return;
+    }
+
+    /* The caller holds a reference too, so VN stays */
+    lock_acquire(filecache_lock);
+    list = filecache_collect(vn, NULL, &n);
+    lock_release(filecache_lock);
+    filecache_release(list);
+}
+
+void
+filecache_flushfs(struct fs *fs)
+{
+    struct filecache_page *list;
+    unsigned n;
+
+    KASSERT(vfs_biglock_do_i_hold());
+
+    if (filecache_lock == NULL) {
+        return;
+    }
+
+    lock_acquire(filecache_lock);
+    list = filecache_collect(NULL, fs, &n);
+    lock_release(filecache_lock);
+    filecache_release(list);
+
+    /* Reclaiming the vnodes is the point here */
+    filecache_drain();
+}
+
+unsigned
+filecache_reclaim(void)
+{
+    struct filecache_page *list;
+    unsigned n;
+
+    /* Called from alloc_kpages, which may be anywhere at all */
+    if (filecache_lock == NULL || curthread->t_in_interrupt ||
+        curthread->t_iplhigh_count > 0 || lock_do_i_hold(filecache_lock)) {
+        return 0;
+    }
+
+    lock_acquire(filecache_lock);
+    list = filecache_collect(NULL, NULL, &n);
+    lock_release(filecache_lock);
+    filecache_release(list);
+    return n;
+}
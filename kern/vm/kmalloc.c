@@ -31,6 +31,13 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <coremap.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -83,12 +90,42 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
+#if OPT_A3
+
+/*
+ * Sizes in steps of half a power of two, so that at most a third of
+ * a block goes unused. Blocks of 1536 and 3072 would waste a quarter
+ * of a page, so they come in slabs of three pages, which they fill
+ * exactly; everything else has a page to itself, and wastes at most
+ * 256 bytes of it.
+ */
+#define NSIZES 16
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072
+};
+static const unsigned slabpages[NSIZES] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 3, 1, 3
+};
+
+#define SMALLEST_SUBPAGE_SIZE 16
+#define LARGEST_SUBPAGE_SIZE 3072
+
+#define SLAB_SIZE(blktype) (slabpages[blktype] * PAGE_SIZE)
+
+#else /* not OPT_A3 */
+
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+#define SLAB_SIZE(blktype) PAGE_SIZE
+
+#endif /* OPT_A3 */
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -107,6 +144,9 @@ struct pageref {
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
+#if OPT_A3
+	uint32_t index;		/* what the coremap tag calls it */
+#endif
 };
 
 #define INVALID_OFFSET   (0xffff)
@@ -117,6 +157,81 @@ struct pageref {
 
 ////////////////////////////////////////
 
+#if OPT_A3
+
+/*
+ * The pagerefs come a page at a time from alloc_kpages, as the heap
+ * needs them, and their pages are never given back. Free ones are
+ * linked through next_samesize.
+ *
+ * A pageref's index is the number of its page in pagerefpages[],
+ * times PAGEREFS_PER_PAGE, plus its place on the page. A pageref is
+ * 20 bytes, so a page holds 204 of them, enough for 816k of heap.
+ * Slabs are always in KSEG0, so there can never be more of them than
+ * KSEG0's 131072 pages; that bounds pagerefpages[] to 643 entries,
+ * 2572 bytes.
+ */
+
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define NPAGEREFPAGES \
+	DIVROUNDUP((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE, PAGEREFS_PER_PAGE)
+
+static struct pageref *pagerefpages[NPAGEREFPAGES];
+static unsigned npagerefpages;
+static struct pageref *freepagerefs;
+
+/* Pagerefs there are so far */
+#define NPAGEREFS (npagerefpages * PAGEREFS_PER_PAGE)
+
+#define PAGEREF(index) \
+	(&pagerefpages[(index) / PAGEREFS_PER_PAGE][(index) % PAGEREFS_PER_PAGE])
+
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pageref *pr;
+
+	pr = freepagerefs;
+	if (pr != NULL) {
+		freepagerefs = pr->next_samesize;
+	}
+	return pr;
+}
+
+static
+void
+freepageref(struct pageref *p)
+{
+	KASSERT(p->index < NPAGEREFS && PAGEREF(p->index) == p);
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+}
+
+/*
+ * Add the page at PAGE to the pagerefs. Call with kmalloc_spinlock
+ * held, after getting the page without it.
+ */
+static
+void
+addpagerefs(vaddr_t page)
+{
+	struct pageref *prs = (struct pageref *)page;
+	unsigned i;
+
+	KASSERT(npagerefpages < NPAGEREFPAGES);
+
+	/* Backwards, so they get handed out in order */
+	for (i=PAGEREFS_PER_PAGE; i-- > 0; ) {
+		prs[i].index = NPAGEREFS + i;
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	pagerefpages[npagerefpages++] = prs;
+}
+
+#else /* not OPT_A3 */
+
 /*
  * This is cheesy. 
  *
@@ -181,6 +296,8 @@ freepageref(struct pageref *p)
 	pagerefs_inuse[i] &= ~k;
 }
 
+#endif /* OPT_A3 */
+
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
@@ -190,9 +307,9 @@ static struct pageref *allbase;
 
 /*
  * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * logic per-cpu is worthwhile for scalability; with OPT_A3 that is
+ * done by the magazines further down, which kmalloc and kfree try
+ * before they take this lock.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -226,7 +343,7 @@ checksubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < SLAB_SIZE(blktype));
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -234,7 +351,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + SLAB_SIZE(blktype));
 		KASSERT((fla-prpage) % sizes[blktype] == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
@@ -301,7 +418,7 @@ dumpsubpage(struct pageref *pr)
 	blktype = PR_BLOCKTYPE(pr);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = SLAB_SIZE(blktype) / sizes[blktype];
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -330,6 +447,46 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_A3
+/*
+ * For each size, print how many slabs there are and how many of their
+ * blocks are out (magazines included), and how much of the blocks
+ * kmalloc has handed out since boot went unused: the internal
+ * fragmentation.
+ */
+static
+void
+kheap_printclasses(void)
+{
+	uint64_t nallocs[CPU_KMAG_CLASSES], nbytes[CPU_KMAG_CLASSES];
+	uint64_t blockbytes;
+	struct pageref *pr;
+	unsigned i, nslabs, nused, unused;
+
+	cpu_kmstats(nallocs, nbytes);
+
+	kprintf("Size   Slabs  Blocks out   kmallocs  Unused\n");
+	for (i=0; i<NSIZES; i++) {
+		nslabs = nused = 0;
+		spinlock_acquire(&kmalloc_spinlock);
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			nslabs++;
+			nused += SLAB_SIZE(i) / sizes[i] - pr->nfree;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		blockbytes = nallocs[i] * sizes[i];
+		unused = 0;
+		if (blockbytes > 0) {
+			unused = ((blockbytes - nbytes[i]) * 100) / blockbytes;
+		}
+		kprintf("%4lu  %6u  %10u  %9llu  %5u%%\n",
+			(unsigned long) sizes[i], nslabs, nused,
+			(unsigned long long) nallocs[i], unused);
+	}
+}
+#endif
+
 void
 kheap_printstats(void)
 {
@@ -345,6 +502,10 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_A3
+	kheap_printclasses();
+#endif
 }
 
 ////////////////////////////////////////
@@ -392,6 +553,23 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Tag every page of the slab at PRPAGE, for blocks of size BLKTYPE,
+ * with KMCLASS and KMREF.
+ */
+static
+void
+tagslab(vaddr_t prpage, unsigned blktype, unsigned kmclass, unsigned kmref)
+{
+	unsigned i;
+
+	for (i=0; i<slabpages[blktype]; i++) {
+		coremap_setkmtag(prpage + i*PAGE_SIZE, kmclass, kmref);
+	}
+}
+#endif
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -423,7 +601,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			KASSERT(pr->freelist_offset < SLAB_SIZE(blktype));
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
@@ -435,7 +613,7 @@ subpage_kmalloc(size_t sz)
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
 				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
+				KASSERT(fla - prpage < SLAB_SIZE(blktype));
 				pr->freelist_offset = fla - prpage;
 			}
 			else {
@@ -460,7 +638,19 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+#if OPT_A3
+	/*
+	 * A slab must be one KSEG0 run, so that each of its pages has a
+	 * coremap tag to find it by. If there is none, kmalloc gives the
+	 * request a page of its own instead, so don't complain.
+	 */
+	prpage = alloc_kpages_contig(slabpages[blktype]);
+	if (prpage==0 && slabpages[blktype] > 1) {
+		return NULL;
+	}
+#else
 	prpage = alloc_kpages(1);
+#endif
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
@@ -469,6 +659,21 @@ subpage_kmalloc(size_t sz)
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
+#if OPT_A3
+	while (pr==NULL) {
+		/* Get another page of them, again without the lock */
+		vaddr_t prspage;
+
+		spinlock_release(&kmalloc_spinlock);
+		prspage = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (prspage==0) {
+			break;
+		}
+		addpagerefs(prspage);
+		pr = allocpageref();
+	}
+#endif
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -478,7 +683,7 @@ subpage_kmalloc(size_t sz)
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = SLAB_SIZE(blktype) / sizes[blktype];
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -504,10 +709,60 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+#if OPT_A3
+	/* So that kfree can tell the size, and find pr, without looking */
+	tagslab(prpage, blktype, blktype + 1, pr->index);
+#endif
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Find the pageref for the slab PTRADDR is on, or return NULL if it
+ * isn't on one of ours. Call with kmalloc_spinlock held.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+#if OPT_A3
+	unsigned kmclass, kmref;
+
+	/*
+	 * The page's coremap tag leads straight to it. Only pages from
+	 * before the coremap existed have no tag, and are looked for.
+	 */
+	if (coremap_getkmtag(ptraddr, &kmclass, &kmref)) {
+		if (kmclass == 0) {
+			return NULL;
+		}
+		KASSERT(kmref < NPAGEREFS);
+		pr = PAGEREF(kmref);
+		KASSERT(PR_BLOCKTYPE(pr) == kmclass - 1);
+		KASSERT(ptraddr - PR_PAGEADDR(pr) < SLAB_SIZE(kmclass - 1));
+		checksubpage(pr);
+		return pr;
+	}
+#endif
+
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage &&
+		    ptraddr < prpage + SLAB_SIZE(PR_BLOCKTYPE(pr))) {
+			break;
+		}
+	}
+	return pr;
+}
+
 static
 int
 subpage_kfree(void *ptr)
@@ -526,29 +781,19 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= SLAB_SIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -573,11 +818,14 @@ subpage_kfree(void *ptr)
 	pr->freelist_offset = offset;
 	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	KASSERT(pr->nfree <= SLAB_SIZE(blktype) / sizes[blktype]);
+	if (pr->nfree == SLAB_SIZE(blktype) / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_A3
+		tagslab(prpage, blktype, 0, 0);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -598,6 +846,240 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Freed blocks of each size are kept in magazines, small stacks
+//    of pointers, and kmalloc takes them from there. Each cpu holds a
+//    loaded magazine and the previous one for each size, which it
+//    uses with interrupts off and no lock at all. Only when both are
+//    empty (for kmalloc) or both are full (for kfree) does it go to
+//    the depot, under kmdepot_spinlock, to trade one for a full or
+//    empty one. Blocks only go to and from the pages above when the
+//    depot can't help.
+//
+//    kfree learns the size of a block from the tag subpage_kmalloc
+//    put on its page in the coremap, so it needs no lock either.
+//    Blocks on pages from before the coremap existed are never
+//    tagged, and always take the slow path.
+//
+//    Blocks in magazines count as allocated as far as the pages are
+//    concerned. To bound what is held that way, a magazine takes at
+//    most a slab's worth of blocks and the depot keeps at most
+//    KDEPOT_MAX full ones per size.
+//
+//    Each cpu also counts its kmalloc calls of each size and the bytes
+//    they asked for, so kheap_printstats can tell how much of the
+//    blocks handed out goes unused.
+//
+
+#if NSIZES > CPU_KMAG_CLASSES
+#error "CPU_KMAG_CLASSES is too small"
+#endif
+
+#define KMAG_ROUNDS 14		/* makes struct kmagazine 64 bytes */
+#define KDEPOT_MAX  4		/* full magazines kept per size */
+#define KMAG_MAX    16		/* magazines in existence per size */
+
+struct kmagazine {
+	struct kmagazine *km_next;	/* on a depot list */
+	unsigned km_rounds;		/* blocks in km_objs */
+	void *km_objs[KMAG_ROUNDS];
+};
+
+struct kdepot {
+	struct kmagazine *kd_full;
+	struct kmagazine *kd_empty;
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+	unsigned kd_nmags;		/* including those the cpus hold */
+};
+
+static struct kdepot kdepots[NSIZES];
+static struct spinlock kmdepot_spinlock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+kmag_capacity(unsigned blktype)
+{
+	unsigned n;
+
+	n = SLAB_SIZE(blktype) / sizes[blktype];
+	return n < KMAG_ROUNDS ? n : KMAG_ROUNDS;
+}
+
+/*
+ * Take a block of size BLKTYPE from this cpu's magazines, or from a
+ * full magazine at the depot. Returns NULL if there is none. SZ is
+ * what the caller asked for, and only goes into the counts.
+ */
+static
+void *
+kmag_alloc(unsigned blktype, size_t sz)
+{
+	struct cpu *c;
+	struct kmagazine *m, *prev, *full;
+	struct kdepot *d;
+	void *ptr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot */
+		return NULL;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	c->c_kmallocs[blktype]++;
+	c->c_kmbytes[blktype] += sz;
+
+	m = c->c_kmag[blktype];
+	if (m == NULL || m->km_rounds == 0) {
+		prev = c->c_kmagprev[blktype];
+		if (prev != NULL && prev->km_rounds > 0) {
+			c->c_kmag[blktype] = prev;
+			c->c_kmagprev[blktype] = m;
+		}
+		else {
+			/* Trade the previous one in for a full one */
+			d = &kdepots[blktype];
+			spinlock_acquire(&kmdepot_spinlock);
+			full = d->kd_full;
+			if (full != NULL) {
+				d->kd_full = full->km_next;
+				d->kd_nfull--;
+				if (prev != NULL) {
+					prev->km_next = d->kd_empty;
+					d->kd_empty = prev;
+					d->kd_nempty++;
+				}
+				c->c_kmagprev[blktype] = m;
+				c->c_kmag[blktype] = full;
+			}
+			spinlock_release(&kmdepot_spinlock);
+			if (full == NULL) {
+				splx(spl);
+				return NULL;
+			}
+		}
+		m = c->c_kmag[blktype];
+	}
+
+	ptr = m->km_objs[--m->km_rounds];
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Put PTR, a block of size BLKTYPE, in this cpu's magazines. Returns
+ * false if there was no room; *GROW is then set if the depot could
+ * use another empty magazine.
+ */
+static
+bool
+kmag_free(void *ptr, unsigned blktype, bool *grow)
+{
+	struct cpu *c;
+	struct kmagazine *m, *prev, *empty;
+	struct kdepot *d;
+	unsigned cap;
+	int spl;
+
+	*grow = false;
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	cap = kmag_capacity(blktype);
+
+	/* Same as in subpage_kfree */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	m = c->c_kmag[blktype];
+	if (m == NULL || m->km_rounds == cap) {
+		prev = c->c_kmagprev[blktype];
+		if (prev != NULL && prev->km_rounds < cap) {
+			c->c_kmag[blktype] = prev;
+			c->c_kmagprev[blktype] = m;
+		}
+		else {
+			/* Trade the previous one in for an empty one */
+			d = &kdepots[blktype];
+			spinlock_acquire(&kmdepot_spinlock);
+			empty = NULL;
+			if (prev != NULL && d->kd_nfull >= KDEPOT_MAX) {
+				/* Holding on to enough already */
+			}
+			else if (d->kd_empty == NULL) {
+				*grow = d->kd_nmags < KMAG_MAX;
+			}
+			else {
+				empty = d->kd_empty;
+				d->kd_empty = empty->km_next;
+				d->kd_nempty--;
+				if (prev != NULL) {
+					prev->km_next = d->kd_full;
+					d->kd_full = prev;
+					d->kd_nfull++;
+				}
+				c->c_kmagprev[blktype] = m;
+				c->c_kmag[blktype] = empty;
+			}
+			spinlock_release(&kmdepot_spinlock);
+			if (empty == NULL) {
+				splx(spl);
+				return false;
+			}
+		}
+		m = c->c_kmag[blktype];
+	}
+
+	m->km_objs[m->km_rounds++] = ptr;
+	splx(spl);
+	return true;
+}
+
+/*
+ * Give the depot another empty magazine for BLKTYPE. The magazines
+ * themselves come straight from the pages, and are never freed.
+ */
+static
+void
+kmag_grow(unsigned blktype)
+{
+	struct kmagazine *m;
+	struct kdepot *d;
+
+	m = subpage_kmalloc(sizeof(struct kmagazine));
+	if (m == NULL) {
+		return;
+	}
+	m->km_rounds = 0;
+
+	d = &kdepots[blktype];
+	spinlock_acquire(&kmdepot_spinlock);
+	if (d->kd_nmags < KMAG_MAX) {
+		m->km_next = d->kd_empty;
+		d->kd_empty = m;
+		d->kd_nempty++;
+		d->kd_nmags++;
+		m = NULL;
+	}
+	spinlock_release(&kmdepot_spinlock);
+
+	if (m != NULL) {
+		/* Somebody else got there first */
+		subpage_kfree(m);
+	}
+}
+
+#endif /* OPT_A3 */
+
 void *
 kmalloc(size_t sz)
 {
@@ -615,12 +1097,60 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#if OPT_A3
+	{
+		unsigned blktype;
+		void *ptr;
+
+		blktype = blocktype(sz);
+		ptr = kmag_alloc(blktype, sz);
+		if (ptr != NULL) {
+			return ptr;
+		}
+
+		ptr = subpage_kmalloc(sz);
+		if (ptr == NULL && slabpages[blktype] > 1) {
+			/* No slab to be had; a page of its own will do */
+			ptr = (void *)alloc_kpages(1);
+		}
+		return ptr;
+	}
+#else
 	return subpage_kmalloc(sz);
+#endif
 }
 
 void
 kfree(void *ptr)
 {
+#if OPT_A3
+	unsigned kmclass, kmref;
+	bool grow;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	/*
+	 * A tagged page is a subpage one, and the tag says what size.
+	 * Anything else the coremap knows about is a page allocation.
+	 */
+	if (coremap_getkmtag((vaddr_t)ptr, &kmclass, &kmref) &&
+	    kmclass == 0) {
+		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		free_kpages((vaddr_t)ptr);
+		return;
+	}
+	if (kmclass != 0) {
+		if (kmag_free(ptr, kmclass - 1, &grow)) {
+			return;
+		}
+		if (grow) {
+			kmag_grow(kmclass - 1);
+		}
+	}
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -0,0 +1,255 @@
+/* Slab caches of constructed objects. See objcache.h */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/*
+ * Each slab is one page: the objects from the start of it, and a
+ * struct objslab at the end. A free object is linked to the next by a
+ * word just past it, so that the object itself stays constructed.
+ * Single pages always come from KSEG0, so an object's slab is found
+ * from its address alone.
+ */
+
+/* Completely free slabs a cache keeps before giving pages back */
+#define OBJCACHE_EMPTYMAX 1
+
+struct objslab {
+    struct objslab *os_next;    /* on oc_partial or oc_empty */
+    struct objslab *os_prev;    /* on oc_partial */
+    void *os_free;              /* free objects */
+    unsigned os_nfree;
+};
+
+struct objcache {
+    char *oc_name;
+    size_t oc_linkoff;          /* where the free link goes */
+    size_t oc_stride;           /* from one object to the next */
+    unsigned oc_perslab;
+    int (*oc_ctor)(void *obj);
+    void (*oc_dtor)(void *obj);
+
+    /* Full slabs are on neither list */
+    struct spinlock oc_lock;
+    struct objslab *oc_partial; /* slabs with objects in use and free */
+    struct objslab *oc_empty;   /* slabs with nothing in use */
+    unsigned oc_nempty;
+};
+
+#define OBJ_LINK(oc, obj) (*(void **)((char *)(obj) + (oc)->oc_linkoff))
+#define OBJ_SLAB(obj) ((struct objslab *)(((vaddr_t)(obj) & PAGE_FRAME) + \
+                                          PAGE_SIZE - sizeof(struct objslab)))
+#define SLAB_PAGE(os) ((vaddr_t)(os) & PAGE_FRAME)
+
+struct objcache *
+objcache_create(const char *name, size_t size, size_t align,
+                int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+    struct objcache *oc;
+
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    KASSERT((align & (align - 1)) == 0);
+
+    oc = kmalloc(sizeof(struct objcache));
+    if (oc == NULL) {
+        return NULL;
+    }
+    oc->oc_name = kstrdup(name);
+    if (oc->oc_name == NULL) {
+        kfree(oc);
+        return NULL;
+    }
+
+    oc->oc_linkoff = ROUNDUP(size, sizeof(void *));
+    oc->oc_stride = ROUNDUP(oc->oc_linkoff + sizeof(void *), align);
+    oc->oc_perslab = (PAGE_SIZE - sizeof(struct objslab)) / oc->oc_stride;
+    KASSERT(oc->oc_perslab > 1);
+    oc->oc_ctor = ctor;
+    oc->oc_dtor = dtor;
+
+    spinlock_init(&oc->oc_lock);
+    oc->oc_partial = NULL;
+    oc->oc_empty = NULL;
+    oc->oc_nempty = 0;
+
+    return oc;
+}
+
+/* Destroy the objects of OS, which are all free, and free its page */
+static
+void
+objcache_release(struct objcache *oc, struct objslab *os)
+{
+    void *obj, *next;
+
+    for (obj = os->os_free; obj != NULL; obj = next) {
+        next = OBJ_LINK(oc, obj);
+        if (oc->oc_dtor != NULL) {
+            oc->oc_dtor(obj);
+        }
+    }
+    free_kpages(SLAB_PAGE(os));
+}
+
+/* Make a new slab of constructed objects. Called without the lock */
+static
+struct objslab *
+objcache_grow(struct objcache *oc)
+{
+    struct objslab *os;
+    vaddr_t page;
+    void *obj;
+    unsigned i;
+
+    page = alloc_kpages(1);
+    if (page == 0) {
+        return NULL;
+    }
+    os = OBJ_SLAB(page);
+    os->os_next = NULL;
+    os->os_prev = NULL;
+    os->os_free = NULL;
+    os->os_nfree = 0;
+
+    /* Backwards, so they get handed out in address order */
+    for (i = oc->oc_perslab; i-- > 0; ) {
+        obj = (void *)(page + i * oc->oc_stride);
+        if (oc->oc_ctor != NULL && oc->oc_ctor(obj) != 0) {
+            /* Undo the ones that worked */
+            objcache_release(oc, os);
+            return NULL;
+        }
+        OBJ_LINK(oc, obj) = os->os_free;
+        os->os_free = obj;
+        os->os_nfree++;
+    }
+    return os;
+}
+
+/* Put OS at the head of oc_partial. Call with the lock held */
+static
+void
+objcache_link(struct objcache *oc, struct objslab *os)
+{
+    os->os_prev = NULL;
+    os->os_next = oc->oc_partial;
+    if (oc->oc_partial != NULL) {
+        oc->oc_partial->os_prev = os;
+    }
+    oc->oc_partial = os;
+}
+
+/* Take OS off oc_partial. Call with the lock held */
+static
+void
+objcache_unlink(struct objcache *oc, struct objslab *os)
+{
+    if (os->os_prev != NULL) {
+        os->os_prev->os_next = os->os_next;
+    }
+    else {
+        oc->oc_partial = os->os_next;
+    }
+    if (os->os_next != NULL) {
+        os->os_next->os_prev = os->os_prev;
+    }
+    os->os_next = NULL;
+    os->os_prev = NULL;
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+    struct objslab *os;
+    void *obj;
+
+    spinlock_acquire(&oc->oc_lock);
+
+    /* Fill up slabs that are in use before starting on an empty one */
+    os = oc->oc_partial;
+    if (os == NULL) {
+        os = oc->oc_empty;
+        if (os != NULL) {
+            oc->oc_empty = os->os_next;
+            oc->oc_nempty--;
+        }
+        else {
+            /* Constructors may sleep, so not with the lock held */
+            spinlock_release(&oc->oc_lock);
+            os = objcache_grow(oc);
+            if (os == NULL) {
+                return NULL;
+            }
+            spinlock_acquire(&oc->oc_lock);
+        }
+        objcache_link(oc, os);
+    }
+
+    obj = os->os_free;
+    os->os_free = OBJ_LINK(oc, obj);
+    os->os_nfree--;
+    if (os->os_nfree == 0) {
+        objcache_unlink(oc, os);
+    }
+
+    spinlock_release(&oc->oc_lock);
+    return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+    struct objslab *os;
+
+    os = OBJ_SLAB(obj);
+    KASSERT(((vaddr_t)obj - SLAB_PAGE(os)) % oc->oc_stride == 0);
+    KASSERT(((vaddr_t)obj - SLAB_PAGE(os)) / oc->oc_stride < oc->oc_perslab);
+
+    spinlock_acquire(&oc->oc_lock);
+
+    if (os->os_nfree == 0) {
+        /* Was full */
+        objcache_link(oc, os);
+    }
+    OBJ_LINK(oc, obj) = os->os_free;
+    os->os_free = obj;
+    os->os_nfree++;
+
+    if (os->os_nfree == oc->oc_perslab) {
+        objcache_unlink(oc, os);
+        if (oc->oc_nempty >= OBJCACHE_EMPTYMAX) {
+            spinlock_release(&oc->oc_lock);
+            objcache_release(oc, os);
+            return;
+        }
+        /* Keep it for the next burst */
+        os->os_next = oc->oc_empty;
+        oc->oc_empty = os;
+        oc->oc_nempty++;
+    }
+
+    spinlock_release(&oc->oc_lock);
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+    struct objslab *os;
+
+    KASSERT(oc->oc_partial == NULL);
+
+    while (oc->oc_empty != NULL) {
+        os = oc->oc_empty;
+        oc->oc_empty = os->os_next;
+        objcache_release(oc, os);
+    }
+
+    spinlock_cleanup(&oc->oc_lock);
+    kfree(oc->oc_name);
+    kfree(oc);
+}
@@ -0,0 +1,139 @@
+/* Swap space for user pages. See swap.h */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#include <swap.h>
+
+/* The swap device, or NULL if we are running without swap */
+static struct vnode *swap_vnode;
+
+/* One bit per page-sized slot on the device; set means in use */
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+
+/* Protects swap_map. The I/O itself is serialized by the disk driver */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+    struct stat st;
+    char path[sizeof(SWAP_DEVICE)];
+    int result;
+
+    /* vfs_open may scribble on the path, so hand it a copy */
+    strcpy(path, SWAP_DEVICE);
+    result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+    if (result) {
+        kprintf("swap: cannot open %s (%s), running without swap\n",
+                SWAP_DEVICE, strerror(result));
+        swap_vnode = NULL;
+        return;
+    }
+
+    result = VOP_STAT(swap_vnode, &st);
+    if (result) {
+        panic("swap: cannot stat %s: %s\n", SWAP_DEVICE, strerror(result));
+    }
+
+    swap_nslots = st.st_size / PAGE_SIZE;
+    if (swap_nslots > SWAP_MAXSLOTS) {
+        swap_nslots = SWAP_MAXSLOTS;
+    }
+    swap_map = bitmap_create(swap_nslots);
+    if (swap_map == NULL) {
+        panic("swap: out of memory for the swap map\n");
+    }
+
+    kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+/* Move one page between PADDR and slot SLOT */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio u;
+    int result;
+
+    KASSERT(slot < swap_nslots);
+
+    uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+              (off_t)slot * PAGE_SIZE, rw);
+    if (rw == UIO_READ) {
+        result = VOP_READ(swap_vnode, &u);
+    }
+    else {
+        result = VOP_WRITE(swap_vnode, &u);
+    }
+    if (result) {
+        return result;
+    }
+    if (u.uio_resid != 0) {
+        return EIO;
+    }
+    return 0;
+}
+
+int
+swap_out(paddr_t paddr, unsigned *slot)
+{
+    int result;
+
+    if (swap_vnode == NULL) {
+        return ENOSPC;
+    }
+
+    spinlock_acquire(&swap_lock);
+    result = bitmap_alloc(swap_map, slot);
+    spinlock_release(&swap_lock);
+    if (result) {
+        /* Swap is full */
+        return ENOSPC;
+    }
+
+    result = swap_io(*slot, paddr, UIO_WRITE);
+    if (result) {
+        swap_free(*slot);
+        return result;
+    }
+
+    vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+    return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+    int result;
+
+    KASSERT(swap_vnode != NULL);
+
+    result = swap_io(slot, paddr, UIO_READ);
+    if (result) {
+        return result;
+    }
+
+    vmstats_inc(VMSTAT_SWAP_FILE_READ);
+    return 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+    spinlock_acquire(&swap_lock);
+    KASSERT(bitmap_isset(swap_map, slot));
+    bitmap_unmark(swap_map, slot);
+    spinlock_release(&swap_lock);
+}
@@ -5,7 +5,9 @@
 /* NOTE !!!!!! WARNING !!!!!
  * All of the functions whose names begin with '_'
  * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * (i.e., outside of these routines): by disabling
+ * interrupts for _vmstats_inc, by acquiring stats_lock
+ * for _vmstats_init.
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally.
  */
@@ -14,10 +16,17 @@
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+/*
+ * Counters for tracking statistics. Each CPU counts in its own set,
+ * so counting takes no lock (and the fault path doesn't all pile up
+ * on one); the sets are added up when the counts are read.
+ */
+static unsigned int stats_counts[MAXCPUS][VMSTAT_COUNT];
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
@@ -37,16 +46,20 @@ static const char *stats_names[] = {
 
 
 /* ---------------------------------------------------------------------- */
-/* Assumes vmstat_init has already been called */
+/* The counters start out at 0; vmstats_init need not have run yet */
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
+    int spl;
+
+    /* Just so we aren't moved to another CPU halfway through */
+    spl = splhigh();
       _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+    splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
+/* Called once, from vm_bootstrap; mostly to check stats_names */
 void
 vmstats_init(void)
 {
@@ -65,7 +78,7 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  stats_counts[curcpu->c_number][index]++;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -73,6 +86,7 @@ void
 _vmstats_init(void)
 {
   int i = 0;
+  int j = 0;
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,22 +94,49 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  for (j=0; j<MAXCPUS; j++) {
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      stats_counts[j][i] = 0;
+    }
   }
 
 }
 
 /* ---------------------------------------------------------------------- */
-/* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* Add up the counts of all the CPUs. Counting may go on meanwhile,
+ * so the totals are only exact when things are quiet.
  */
+void
+vmstats_snapshot(unsigned int *counts)
+{
+  int i = 0;
+  int j = 0;
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    counts[i] = 0;
+    for (j=0; j<MAXCPUS; j++) {
+      counts[i] += stats_counts[j][i];
+    }
+  }
+}
 
+/* ---------------------------------------------------------------------- */
 void
 vmstats_print(void)
 {
+  vmstats_print_since(NULL);
+}
+
+/* ---------------------------------------------------------------------- */
+/* NOTE: Nothing is locked here (kprintf may block, and we can't block
+ * while holding a spinlock); see vmstats_snapshot.
+ * Just use this when things are quiet.
+ */
+
+void
+vmstats_print_since(const unsigned int *since)
+{
+  unsigned int counts[VMSTAT_COUNT];
   int i = 0;
   int free_plus_replace = 0;
   int disk_plus_zeroed_plus_reload = 0;
@@ -103,17 +144,24 @@ vmstats_print(void)
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
 
+  vmstats_snapshot(counts);
+  if (since != NULL) {
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      counts[i] -= since[i];
+    }
+  }
+
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
-    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
+    kprintf("VMSTAT %25s = %10d\n", stats_names[i], counts[i]);
   }
 
-  tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
-  free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
-  disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
-  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  tlb_faults = counts[VMSTAT_TLB_FAULT];
+  free_plus_replace = counts[VMSTAT_TLB_FAULT_FREE] + counts[VMSTAT_TLB_FAULT_REPLACE];
+  disk_plus_zeroed_plus_reload = counts[VMSTAT_PAGE_FAULT_DISK] +
+    counts[VMSTAT_PAGE_FAULT_ZERO] + counts[VMSTAT_TLB_RELOAD];
+  elf_plus_swap_reads = counts[VMSTAT_ELF_FILE_READ] + counts[VMSTAT_SWAP_FILE_READ];
+  disk_reads = counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
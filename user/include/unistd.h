@@ -39,6 +39,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -147,6 +148,8 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(int change);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
 int getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
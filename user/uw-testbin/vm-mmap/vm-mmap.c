@@ -0,0 +1,221 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_SIZE (4096)
+#define PAGES     (4)
+#define SIZE      (PAGE_SIZE * PAGES)
+
+/* Scratch file, made next to our own executable */
+#define DATAFILE  "vm-mmap.dat"
+
+/*
+ * Three tests of mmap against the file system:
+ *
+ *  - Map our own executable twice, privately. Writes to one mapping
+ *    must not show up in the other, nor in the file as read().
+ *
+ *  - Map a scratch file shared, write to it, msync and munmap it.
+ *    read() must then return what was written.
+ *
+ *  - write() to the scratch file and map it again. The mapping must
+ *    show what was written.
+ *
+ * The scratch file goes in the same directory as the executable,
+ * since mmap needs a file system that supports it and that one does.
+ */
+
+/* Test-only stand-ins for mmap, read and write, by path; see <kern/mman.h> */
+void *mmap_path(void *addr, size_t len, int prot, int flags,
+		const char *path, off_t offset);
+int pread_path(const char *path, void *buf, size_t len, off_t offset);
+int pwrite_path(const char *path, const void *buf, size_t len,
+		off_t offset);
+
+static char buf[SIZE];
+static char datapath[PATH_MAX];
+
+static
+void
+check_elf(const char *p, const char *what)
+{
+	if (p[0] != 0x7f || p[1] != 'E' || p[2] != 'L' || p[3] != 'F') {
+		printf("FAILED %s: no ELF header\n", what);
+		exit(1);
+	}
+}
+
+/* The byte at I of the scratch file, as written by round N */
+static
+char
+pattern(unsigned int i, int n)
+{
+	return (char)(i * (2 * n + 1) + n);
+}
+
+static
+void
+test_private(const char *prog)
+{
+	char *a, *b;
+	unsigned int i;
+	int len;
+
+	a = mmap_path(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		      prog, 0);
+	if (a == MAP_FAILED) {
+		printf("FAILED mmap of %s\n", prog);
+		exit(1);
+	}
+	check_elf(a, "first mapping");
+
+	for (i=0; i<SIZE; i++) {
+		a[i] = (char)i;
+	}
+
+	b = mmap_path(NULL, SIZE, PROT_READ, MAP_PRIVATE, prog, 0);
+	if (b == MAP_FAILED || b == a) {
+		printf("FAILED second mmap of %s\n", prog);
+		exit(1);
+	}
+	check_elf(b, "second mapping");
+
+	for (i=0; i<SIZE; i++) {
+		if (a[i] != (char)i) {
+			printf("FAILED a[%d] = %d != %d\n", i, a[i], (char)i);
+			exit(1);
+		}
+	}
+
+	len = pread_path(prog, buf, SIZE, 0);
+	if (len <= 0) {
+		printf("FAILED read of %s\n", prog);
+		exit(1);
+	}
+	check_elf(buf, "file after private writes");
+	for (i=0; i<(unsigned int)len; i++) {
+		if (buf[i] != b[i]) {
+			printf("FAILED file[%d] = %d != %d\n", i, buf[i], b[i]);
+			exit(1);
+		}
+	}
+
+	if (munmap(a, SIZE) != 0 || munmap(b, SIZE) != 0) {
+		printf("FAILED munmap\n");
+		exit(1);
+	}
+}
+
+static
+void
+test_shared_msync(void)
+{
+	char *p;
+	unsigned int i;
+
+	memset(buf, 0, SIZE);
+	if (pwrite_path(datapath, buf, SIZE, 0) != SIZE) {
+		printf("FAILED write of %s\n", datapath);
+		exit(1);
+	}
+
+	p = mmap_path(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      datapath, 0);
+	if (p == MAP_FAILED) {
+		printf("FAILED shared mmap of %s\n", datapath);
+		exit(1);
+	}
+	for (i=0; i<SIZE; i++) {
+		if (p[i] != 0) {
+			printf("FAILED p[%d] = %d before writing\n", i, p[i]);
+			exit(1);
+		}
+		p[i] = pattern(i, 1);
+	}
+
+	if (msync(p, SIZE, MS_SYNC) != 0) {
+		printf("FAILED msync\n");
+		exit(1);
+	}
+	if (munmap(p, SIZE) != 0) {
+		printf("FAILED munmap of shared mapping\n");
+		exit(1);
+	}
+
+	if (pread_path(datapath, buf, SIZE, 0) != SIZE) {
+		printf("FAILED read of %s\n", datapath);
+		exit(1);
+	}
+	for (i=0; i<SIZE; i++) {
+		if (buf[i] != pattern(i, 1)) {
+			printf("FAILED file[%d] = %d != %d after msync\n",
+			       i, buf[i], pattern(i, 1));
+			exit(1);
+		}
+	}
+}
+
+static
+void
+test_write_then_map(void)
+{
+	char *p;
+	unsigned int i;
+	char want;
+
+	/* Rewrite the second page only */
+	for (i=0; i<PAGE_SIZE; i++) {
+		buf[i] = pattern(PAGE_SIZE + i, 2);
+	}
+	if (pwrite_path(datapath, buf, PAGE_SIZE, PAGE_SIZE) != PAGE_SIZE) {
+		printf("FAILED write of %s\n", datapath);
+		exit(1);
+	}
+
+	p = mmap_path(NULL, SIZE, PROT_READ, MAP_SHARED, datapath, 0);
+	if (p == MAP_FAILED) {
+		printf("FAILED shared mmap of %s\n", datapath);
+		exit(1);
+	}
+	for (i=0; i<SIZE; i++) {
+		want = pattern(i, i / PAGE_SIZE == 1 ? 2 : 1);
+		if (p[i] != want) {
+			printf("FAILED p[%d] = %d != %d after write\n",
+			       i, p[i], want);
+			exit(1);
+		}
+	}
+	if (munmap(p, SIZE) != 0) {
+		printf("FAILED munmap of shared mapping\n");
+		exit(1);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	char *s;
+
+	(void)argc;
+
+	if (strlen(argv[0]) + strlen(DATAFILE) >= PATH_MAX) {
+		printf("FAILED: %s is too long\n", argv[0]);
+		exit(1);
+	}
+	strcpy(datapath, argv[0]);
+	s = strrchr(datapath, '/');
+	if (s == NULL) {
+		s = strrchr(datapath, ':');
+	}
+	s = (s == NULL) ? datapath : s + 1;
+	strcpy(s, DATAFILE);
+
+	test_private(argv[0]);
+	test_shared_msync();
+	test_write_then_map();
+
+	printf("SUCCEEDED\n");
+	exit(0);
+}